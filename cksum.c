@@ -0,0 +1,208 @@
+/* Internet checksum kernels */
+
+#include <stddef.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "rlib.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>
+# define HAVE_CKSUM_X86 1
+#endif
+
+/* The vector kernels add up the data as native-endian 16-bit words.
+ * One's complement addition commutes with byte swapping (RFC 1071),
+ * so the folded sum is already in network byte order. */
+
+static uint16_t
+cksum_fold (uint64_t sum)
+{
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+    sum = (uint16_t) ~sum;
+    return sum ? sum : 0xffff;
+}
+
+/* Adds the bytes that don't fill a whole vector */
+static uint64_t
+cksum_tail (const uint8_t *data, int len, uint64_t sum)
+{
+    uint16_t w;
+
+    for (; len >= 2; data += 2, len -= 2) {
+        memcpy (&w, data, 2);
+        sum += w;
+    }
+    if (len > 0) {
+        w = 0;
+        memcpy (&w, data, 1);
+        sum += w;
+    }
+    return sum;
+}
+
+/* Adjusts a checksum produced by cksum() for len bytes of the
+ * checksummed data changing from old to new, without touching the
+ * rest of the packet (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).
+ * The field has to start at an even offset and len must be even. */
+uint16_t
+cksum_update (uint16_t sum, const void *old, const void *new, int len)
+{
+    const uint8_t *o = old, *n = new;
+    uint64_t acc = (uint16_t) ~sum;
+    uint16_t w;
+
+    for (; len >= 2; o += 2, n += 2, len -= 2) {
+        memcpy (&w, o, 2);
+        acc += (uint16_t) ~w;
+        memcpy (&w, n, 2);
+        acc += w;
+    }
+    return cksum_fold (acc);
+}
+
+/* Returns the checksum of two buffers back to back, given cksum() of
+ * each, where the first one has an even length. */
+uint16_t
+cksum_combine (uint16_t a, uint16_t b)
+{
+    return cksum_fold ((uint16_t) ~a + (uint16_t) ~b);
+}
+
+static uint16_t
+cksum_scalar (const void *_data, int len)
+{
+    const uint8_t *data = _data;
+    uint32_t sum;
+
+    for (sum = 0;len >= 2; data += 2, len -= 2)
+        sum += data[0] << 8 | data[1];
+    if (len > 0)
+        sum += data[0] << 8;
+    while (sum > 0xffff)
+        sum = (sum >> 16) + (sum & 0xffff);
+    sum = htons (~sum);
+    return sum ? sum : 0xffff;
+}
+
+#if HAVE_CKSUM_X86
+/* Each 32-bit lane takes up to 4 words per iteration, so the lanes are
+ * folded into the 64-bit sum before they can overflow. */
+#define CKSUM_BLOCK 8192
+
+__attribute__ ((target ("sse2")))
+static uint16_t
+cksum_sse2 (const void *_data, int len)
+{
+    const uint8_t *data = _data;
+    const __m128i zero = _mm_setzero_si128 ();
+    uint32_t lanes[4];
+    uint64_t sum = 0;
+    int i;
+
+    while (len >= 32) {
+        __m128i acc = zero;
+
+        for (i = 0; i < CKSUM_BLOCK && len >= 32; i++, data += 32, len -= 32) {
+            __m128i a = _mm_loadu_si128 ((const __m128i *) data);
+            __m128i b = _mm_loadu_si128 ((const __m128i *) (data + 16));
+            acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (a, zero));
+            acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (a, zero));
+            acc = _mm_add_epi32 (acc, _mm_unpacklo_epi16 (b, zero));
+            acc = _mm_add_epi32 (acc, _mm_unpackhi_epi16 (b, zero));
+        }
+
+        _mm_storeu_si128 ((__m128i *) lanes, acc);
+        sum += (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return cksum_fold (cksum_tail (data, len, sum));
+}
+
+__attribute__ ((target ("avx2")))
+static uint16_t
+cksum_avx2 (const void *_data, int len)
+{
+    const uint8_t *data = _data;
+    const __m256i zero = _mm256_setzero_si256 ();
+    uint32_t lanes[8];
+    uint64_t sum = 0;
+    int i;
+
+    while (len >= 64) {
+        __m256i acc = zero;
+
+        for (i = 0; i < CKSUM_BLOCK && len >= 64; i++, data += 64, len -= 64) {
+            __m256i a = _mm256_loadu_si256 ((const __m256i *) data);
+            __m256i b = _mm256_loadu_si256 ((const __m256i *) (data + 32));
+            acc = _mm256_add_epi32 (acc, _mm256_unpacklo_epi16 (a, zero));
+            acc = _mm256_add_epi32 (acc, _mm256_unpackhi_epi16 (a, zero));
+            acc = _mm256_add_epi32 (acc, _mm256_unpacklo_epi16 (b, zero));
+            acc = _mm256_add_epi32 (acc, _mm256_unpackhi_epi16 (b, zero));
+        }
+
+        _mm256_storeu_si256 ((__m256i *) lanes, acc);
+        for (i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    /* Less than 64 bytes left, take 32 of them at once */
+    if (len >= 32) {
+        __m256i a = _mm256_loadu_si256 ((const __m256i *) data);
+        __m256i acc = _mm256_add_epi32 (_mm256_unpacklo_epi16 (a, zero),
+                                        _mm256_unpackhi_epi16 (a, zero));
+        _mm256_storeu_si256 ((__m256i *) lanes, acc);
+        for (i = 0; i < 8; i++)
+            sum += lanes[i];
+        data += 32;
+        len -= 32;
+    }
+
+    return cksum_fold (cksum_tail (data, len, sum));
+}
+#endif /* HAVE_CKSUM_X86 */
+
+/* Below this many bytes the vector kernels don't fill a single vector,
+ * and the scalar loop is faster.  That covers ACKs and headers. */
+#define CKSUM_SMALL 32
+
+static struct cksum_kernel kernels[4];
+static uint16_t (*cksum_impl) (const void *, int) = cksum_scalar;
+
+/* Picks the kernels once at startup, before any threads can race to */
+__attribute__ ((constructor))
+static void
+cksum_init (void)
+{
+    int n = 0;
+
+    kernels[n].name = "scalar";
+    kernels[n++].fn = cksum_scalar;
+#if HAVE_CKSUM_X86
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("sse2")) {
+        kernels[n].name = "sse2";
+        kernels[n++].fn = cksum_sse2;
+    }
+    if (__builtin_cpu_supports ("avx2")) {
+        kernels[n].name = "avx2";
+        kernels[n++].fn = cksum_avx2;
+    }
+#endif /* HAVE_CKSUM_X86 */
+    cksum_impl = kernels[n - 1].fn;
+}
+
+const struct cksum_kernel *
+cksum_kernels (void)
+{
+    return kernels;
+}
+
+uint16_t
+cksum (const void *data, int len)
+{
+    if (len < CKSUM_SMALL)
+        return cksum_scalar (data, len);
+    return cksum_impl (data, len);
+}
@@ -0,0 +1,75 @@
+/* Microbenchmark for the checksum kernels: checks that they agree with
+ * the scalar version and compares their speed on packet-sized inputs. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "rlib.h"
+
+#define ITERATIONS 2000000
+
+static double
+now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main (void)
+{
+    static const int sizes[] = { 8, 12, 20, 64, 128, 256, 500, 512 };
+    const struct cksum_kernel *kernels = cksum_kernels ();
+    const struct cksum_kernel *k;
+    unsigned char buf[4096 + 64];
+    volatile uint16_t sink = 0;
+    size_t i;
+    int len, off, j;
+
+    /* Sums that fold to 0 and 0xffff */
+    memset (buf, 0xff, sizeof (buf));
+    for (k = kernels + 1; k->name; k++)
+        if (k->fn (buf, 512) != kernels[0].fn (buf, 512)) {
+            fprintf (stderr, "%s: mismatch on all-ones input\n", k->name);
+            return 1;
+        }
+
+    srand (1);
+    for (i = 0; i < sizeof (buf); i++)
+        buf[i] = rand ();
+
+    /* All lengths and alignments must match the reference */
+    for (len = 0; len <= 4096; len++)
+        for (off = 0; off < 4; off++)
+            for (k = kernels + 1; k->name; k++)
+                if (k->fn (buf + off, len) != kernels[0].fn (buf + off, len)) {
+                    fprintf (stderr, "%s: mismatch at len %d, offset %d\n",
+                             k->name, len, off);
+                    return 1;
+                }
+    printf ("%6s", "bytes");
+    for (k = kernels; k->name; k++)
+        printf (" %10s", k->name);
+    printf ("   (ns per call, speedup over scalar)\n");
+
+    for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+        double base = 0;
+
+        printf ("%6d", sizes[i]);
+        for (k = kernels; k->name; k++) {
+            double start = now_ns (), ns;
+            for (j = 0; j < ITERATIONS; j++)
+                sink += k->fn (buf + (j & 7) * 8, sizes[i]);
+            ns = (now_ns () - start) / ITERATIONS;
+            if (k == kernels)
+                base = ns;
+            printf (" %5.1f %3.1fx", ns, base / ns);
+        }
+        printf ("\n");
+    }
+
+    return 0;
+}
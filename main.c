@@ -0,0 +1,191 @@
+/* Command line front end of the reliable transport: relays stdin and
+ * stdout over UDP, or in server mode, relays UDP peers to TCP. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "rlib.h"
+
+/* The output buffer has to take at least one full payload, or
+ * received packets can never be delivered */
+#define PAYLOAD_MAX ((int) sizeof (((packet_t *) 0)->data))
+
+static void
+usage (void)
+{
+    fprintf (stderr,
+                "usage: %s [options] udp-port [host:]udp-port\n"
+                "       %s [options] -s [-T threads [-S]] udp-port [host:]tcp-port\n"
+                "options: -w window  packets in flight, default 1\n"
+                "         -t timeout initial retransmission timeout in ms, at least 10\n"
+                "         -r retries give up after this many unanswered retransmissions\n"
+                "         -n         coalesce input into full packets (Nagle)\n"
+                "         -k cork    like -n, but hold partial packets back at most cork ms\n"
+                "         -a n       acknowledge every n in-order packets, default 2\n"
+                "         -A delay   ...or after this many ms, at most %d\n"
+                "         -o outbuf  bytes of output buffering, at least %d\n"
+                "         -m         send regular input files from a mapping, the file\n"
+                "                    must not grow or shrink while it's sent\n"
+                "         -e         wait for events with epoll\n"
+                "         -i         send and receive through io_uring\n"
+                "         -b batch   datagrams received per system call\n"
+                "         -g         coalesce full packets with GSO/GRO\n"
+                "         -s         relay each UDP peer to its own TCP connection\n"
+                "         -T threads server threads, each with its own socket\n"
+                "         -S         steer each peer to the same thread\n"
+                "         -d         print packets and progress\n"
+                "         -l         log input and output to PID.in.log, PID.out.log\n"
+                , progname, progname, ACK_DELAY_MAX, PAYLOAD_MAX);
+    exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct option o[] = {
+        { "debug", no_argument, NULL, 'd' },
+        { "epoll", no_argument, NULL, 'e' },
+        { "io-uring", no_argument, NULL, 'i' },
+        { "batch", required_argument, NULL, 'b' },
+        { "outbuf", required_argument, NULL, 'o' },
+        { "mmap", no_argument, NULL, 'm' },
+        { "gso", no_argument, NULL, 'g' },
+        { "window", required_argument, NULL, 'w' },
+        { "nagle", no_argument, NULL, 'n' },
+        { "cork", required_argument, NULL, 'k' },
+        { "ack-every", required_argument, NULL, 'a' },
+        { "ack-delay", required_argument, NULL, 'A' },
+        { "retries", required_argument, NULL, 'r' },
+        { "server", no_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 'T' },
+        { "steer", no_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    int opt_server = 0;
+    int opt_threads = 1;
+    int opt_steer = 0;
+    char *local = NULL;
+    char *remote = NULL;
+    struct config_common c;
+    struct sigaction sa;
+    loop_t *l;
+
+    /* Ignore SIGPIPE, since we may get a lot of these */
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction (SIGPIPE, &sa, NULL);
+
+    memset (&c, 0, sizeof (c));
+    c.window = 1;
+    c.timeout = 2000;
+    c.ack_every = 2;
+    c.ack_delay = 5;
+
+    progname = strrchr (argv[0], '/');
+    if (progname)
+        progname++;
+    else
+        progname = argv[0];
+
+    while ((opt = getopt_long (argc, argv, "a:A:b:cdegik:mno:r:sSt:T:uw:l", o, NULL)) != -1)
+        switch (opt) {
+        case 'b':
+            opt_batch = atoi (optarg);
+            break;
+        case 'm':
+            opt_mmap = 1;
+            break;
+        case 's':
+            opt_server = 1;
+            break;
+        case 'T':
+            opt_threads = atoi (optarg);
+            break;
+        case 'S':
+            opt_steer = 1;
+            break;
+        case 'o':
+            opt_outbuf = atol (optarg);
+            break;
+        case 'd':
+            opt_debug = 1;
+            break;
+        case 'g':
+            opt_gso = 1;
+            break;
+        case 'e':
+            opt_epoll = 1;
+            break;
+        case 'l':
+            {
+                char name[40];
+                snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
+                log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+                if (log_in < 0)
+                    perror (name);
+                snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
+                log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
+                if (log_out < 0)
+                    perror (name);
+            }
+            break;
+        case 'i':
+            opt_uring = 1;
+            break;
+        case 'w':
+            c.window = atoi (optarg);
+            break;
+        case 't':
+            c.timeout = atoi (optarg);
+            break;
+        case 'n':
+            c.nagle = 1;
+            break;
+        case 'a':
+            c.ack_every = atoi (optarg);
+            break;
+        case 'A':
+            c.ack_delay = atoi (optarg);
+            break;
+        case 'r':
+            c.max_retries = atoi (optarg);
+            break;
+        case 'k':
+            c.nagle = 1;
+            c.cork = atoi (optarg);
+            break;
+        default:
+            usage ();
+            break;
+        }
+
+    if (optind + 2 != argc || c.window < 1 || c.timeout < 10
+            || opt_batch < 1 || opt_outbuf < PAYLOAD_MAX || c.cork < 0 || c.ack_every < 1
+            || c.ack_delay < 0 || c.ack_delay > ACK_DELAY_MAX || c.max_retries < 0 || opt_threads < 1
+            || (!opt_server && (opt_threads > 1 || opt_steer))) {
+        usage ();
+    }
+
+    local = argv[optind];
+    remote = argv[optind+1];
+
+    if (opt_server)
+        server_main (local, remote, opt_threads, opt_steer, &c);
+
+    c.single_connection = 1;
+    if (!(l = loop_create ()))
+        exit (1);
+    if (!conn_open (l, local, remote, 0, 1, &c))
+        exit (1);
+    loop_run (l, &c);
+
+    return 0;
+}
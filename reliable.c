@@ -16,17 +16,44 @@
 
 #define PAYLOAD_SIZE 500
 
+// Most buffers a single readv() accepts (IOV_MAX on Linux).
+#define READV_MAX 1024
+
+// Bounds of the adaptive retransmission timeout in milliseconds.
+#define RTO_MIN 10
+#define RTO_MAX 60000
+
+// Delayed ACKs must not run into the smallest timeout.
+#if 2 * ACK_DELAY_MAX > RTO_MIN
+#error "ACK_DELAY_MAX has to stay well below RTO_MIN"
+#endif
+
+// Largest window, seqnos wrap around and are only compared within half
+// the sequence space (RFC 1982). Sender and receiver windows together,
+// plus old duplicates still in the network, have to fit into it.
+#define WINDOW_MAX (1 << 29)
+
 
 // [BUFFER]
 
+// A slot of the send buffer, remembers when its packet went out.
+// The payload follows the header, unless it is a slice of the mapped input.
+struct slot {
+    packet_t*       pkt;
+    const char*     data;    // Payload of the packet.
+    struct timespec sent;    // CLOCK_MONOTONIC time of the last transmission.
+    int             retries; // Number of retransmissions so far.
+};
+
 // A ringbuffer is used to buffer packets
 // that are waiting for further processing.
 struct ringbuf {
-    uint32_t    reader; // really the LAR pointer in our case
-    uint32_t    writer; // really the LFS pointer in our case
-    size_t      size;
-    size_t      count;
-    packet_t*   buffer;
+    uint32_t        reader; // really the LAR pointer in our case
+    uint32_t        writer; // really the LFS pointer in our case
+    size_t          size;
+    size_t          count;
+    struct slot*    buffer;
+    char*           store;  // Packets of the slots, or just their headers if the input is mapped.
 };
 
 // Returns the number of available slots for the writer.
@@ -34,11 +61,22 @@ uint32_t buf_space (struct ringbuf* buf) {
     return buf->size - buf->count;
 }
 
-// Places a packet on the ringbuffer if space is left.
+// Returns the slot the writer will fill next,
+// or NULL if the buffer is full. Packets are built in place there.
+struct slot* free_slot (struct ringbuf* buf) {
+    if (buf->count < buf->size) {
+        return &(buf->buffer[buf->writer]);
+    } else {
+        return NULL;
+    }
+}
+
+// Appends the packet built in the free slot to the ringbuffer.
 // Returns 0 if the operation succeeded, 1 otherwise.
-int put_pkt (struct ringbuf* buf, packet_t* pkt) {
+int put_pkt (struct ringbuf* buf) {
     if (buf->count < buf->size) {
-        buf->buffer[buf->writer] = *pkt;
+        buf->buffer[buf->writer].retries = 0;
+        clock_gettime(CLOCK_MONOTONIC, &(buf->buffer[buf->writer].sent));
         buf->writer = (buf->writer + 1) % (buf->size);
         buf->count += 1;
 
@@ -51,7 +89,7 @@ int put_pkt (struct ringbuf* buf, packet_t* pkt) {
 // Reads the next packet from the ringbuffer, if one is available.
 packet_t* read_pkt (struct ringbuf* buf) {
     if (buf->count > 0) {
-        return &(buf->buffer[buf->reader]);
+        return buf->buffer[buf->reader].pkt;
     } else {
         return NULL;
     }
@@ -71,6 +109,25 @@ int pop_pkt (struct ringbuf* buf) {
     }
 }
 
+// The receive window buffers packets that arrived out of order,
+// until the gap in front of them has been filled.
+struct rcvbuf {
+    uint32_t    head;   // Slot of the packet with seqno == next_ackno.
+    size_t      size;
+    packet_t*   buffer; // A slot is empty if its len is 0.
+};
+
+// Returns the slot for the packet <offset> seqnos after next_ackno.
+packet_t* rcv_slot (struct rcvbuf* buf, uint32_t offset) {
+    return &(buf->buffer[(buf->head + offset) % buf->size]);
+}
+
+// Empties the head slot and moves the window forward by one.
+void rcv_advance (struct rcvbuf* buf) {
+    buf->buffer[buf->head].len = 0;
+    buf->head = (buf->head + 1) % (buf->size);
+}
+
 
 // [STATE]
 
@@ -81,22 +138,49 @@ struct reliable_state {
     conn_t*     c; // The connection
 
     struct ringbuf* pkt_buf;
-
-    // The highest unacked seqno of the packet buffer <interval>-ago.
-    // Each packet in the current buffer with seqno <= latest_seqno_snapshot has timed out.
-    uint32_t    latest_seqno_snapshot;
-
-    int         timer; // Store timer configuration.
-    int         timeout; // Store timeout configuration.
-    int         next_timeout; // Milliseconds until the next timeout period.
+    struct rcvbuf*  rcv_buf;
+    struct iovec*   send_iov; // Batch of packets to send at once, header and payload of each window slot.
+    struct iovec*   rcv_iov;  // Batch of payloads to output at once.
+
+    // Retransmission timeout estimation (RFC 6298), the
+    // smoothed round-trip time and its variation are in microseconds.
+    long        srtt;
+    long        rttvar;
+    int         rto; // Current retransmission timeout in milliseconds.
+    int         timeout; // Configured timeout, until the first RTT sample.
+    int         max_retries; // Retransmissions without hearing from the peer before giving up, 0 for no limit.
+    int         silent;      // Retransmissions since the last packet from the peer.
+    int         single_connection; // Exit instead of just ending the session then.
 
     uint32_t    next_ackno; // Next packet expected in this stream.
     uint32_t    next_seqno; // The next sequence number in this stream.
 
+    // Coalescing of partial packets (Nagle), the input held back
+    // sits in the payload of the next free slot of the send buffer.
+    int         nagle;
+    int         cork;        // Milliseconds a partial packet may be held back, 0 for no limit.
+    int         tail_len;    // Bytes held back.
+    struct timespec tail_since; // When the first of them was read.
+    uint32_t    small_seqno; // Seqno of the newest partial packet sent.
+    int         small_unacked; // It hasn't been acknowledged yet.
+
+    // Delayed ACKs, in-order packets are acknowledged every ack_every
+    // packets or ack_delay milliseconds after the first one, whichever is first.
+    int         ack_every;
+    int         ack_delay;
+    int         unacked;   // Packets delivered since our last ACK.
+    struct timespec ack_since; // When the first of them arrived.
+
+    // Input file mapping, if the payloads are sent right out of it.
+    const char* map;
+    size_t      map_len;
+    size_t      map_off; // Start of the next payload.
+
     // State flags
-    int         read_error;
+    int         input_eof; // conn_input reported EOF.
+    int         read_error; // Our EOF has been queued.
+    int         eof_recvd; // The EOF of the other side has been output.
 };
-rel_t *rel_list;
 
 
 // [HELPER FUNCTIONS]
@@ -107,121 +191,434 @@ uint32_t get_seqno(packet_t* pkt) {
     return ntohl(pkt->seqno);
 }
 
+// Serial number comparison of seqnos (RFC 1982), this stays correct
+// when the 32 bit counters wrap around, as long as a and b are less
+// than 2^31 apart.
+int seq_lt (uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
 // Returns a packets length in host-order.
 // @TODO: Could be implemented as a macro to save the function call.
 uint32_t get_size(packet_t* pkt) {
     return ntohs(pkt->len);
 }
 
-// Tries to enqueue a new packet with the given payload in the current window.
-// Will automatically transform the packet data to network ordering.
-// If this succeeds, it will immediately send the packet.
+// Returns the milliseconds passed between two points in time.
+long elapsed_ms (const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+// Returns the microseconds passed between two points in time.
+long elapsed_us (const struct timespec* from, const struct timespec* to) {
+    return (to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+// Recomputes the RTO from the current estimate, undoing any backoff.
+// Without a sample yet, that is the configured timeout.
+void reset_rto (rel_t* r) {
+    if (r->srtt == 0) {
+        r->rto = r->timeout;
+        return;
+    }
+
+    // Round up to whole milliseconds, the clamp covers the clock granularity.
+    r->rto = (r->srtt + 4 * r->rttvar + 999) / 1000;
+    if (r->rto < RTO_MIN) {
+        r->rto = RTO_MIN;
+    } else if (r->rto > RTO_MAX) {
+        r->rto = RTO_MAX;
+    }
+}
+
+// Feeds a round-trip time sample into the RTO estimation.
+void update_rto (rel_t* r, long rtt) {
+    if (r->srtt == 0) {
+        // First measurement.
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        long delta = r->srtt > rtt ? r->srtt - rtt : rtt - r->srtt;
+
+        r->rttvar = (3 * r->rttvar + delta) / 4;
+        r->srtt = (7 * r->srtt + rtt) / 8;
+    }
+
+    reset_rto(r);
+}
+
+
+// Rewrites the ackno (in network order) of a buffered packet,
+// patching its checksum instead of recomputing it over the payload.
+void set_ackno (packet_t* pkt, uint32_t ackno) {
+    if (pkt->ackno != ackno) {
+        pkt->cksum = cksum_update(pkt->cksum, &pkt->ackno, &ackno, sizeof(ackno));
+        pkt->ackno = ackno;
+    }
+}
+
+// Tries to enqueue the packet in the free slot, whose payload of
+// len bytes has already been placed there by the caller.
+// Will automatically transform the packet header to network ordering.
+// The caller has to send the packet with send_slots.
 // Returns 0 if it succeeded, 1 otherwise.
-int ingest_pkt (rel_t* r, void* payload, int len) {
-    // Check for buffer space early, so we don't waste work.
-    if (buf_space(r->pkt_buf) > 0) {
+int ingest_pkt (rel_t* r, int len) {
+    struct slot* slot = free_slot(r->pkt_buf);
+
+    if (slot != NULL) {
+        packet_t* pkt = slot->pkt;
         uint16_t pkt_size = 12;
         if (len > 0) {
             pkt_size = len + 12;
         }
 
-        packet_t* pkt = (packet_t*) xmalloc(sizeof(packet_t));
-
         pkt->cksum  = 0;
         pkt->seqno  = htonl(r->next_seqno++);
         pkt->ackno  = htonl(r->next_ackno);
         pkt->len    = htons(pkt_size); // payload size + header size
 
-        // Set payload.
-        if (len > 0) {
-            memcpy(pkt->data, payload, len);
-        }
+        // Compute checksum, the payload might not follow the header.
+        pkt->cksum  = cksum_combine(cksum(pkt, 12), cksum(slot->data, pkt_size - 12)); // don't use pkt->len here, it's in network order
 
-        // Compute checksum.
-        pkt->cksum  = cksum(pkt, pkt_size); // don't use pkt->len here, it's in network order
+        if (len > 0 && len < PAYLOAD_SIZE) {
+            r->small_seqno = get_seqno(pkt);
+            r->small_unacked = 1;
+        }
 
         // The packet is placed under LAST_FRAME_SENT, so we need to actually send it.
-        if (len > 0) {
-            // Enqueue, guaranteed to succeed because we checked for buf_space above.
-            put_pkt(r->pkt_buf, pkt);
-            // fprintf(stderr, "[SEND] %u\n", get_seqno(pkt));
+        // EOF is buffered as well, it occupies a seqno and might get lost.
+        // Enqueue, guaranteed to succeed because we got a free slot above.
+        put_pkt(r->pkt_buf);
+        // fprintf(stderr, "[SEND] %u\n", get_seqno(pkt));
+
+        // Older packets time out first, unless there are none.
+        if (r->pkt_buf->count == 1) {
+            conn_settimer(r->c, r->rto);
         }
 
-        conn_sendpkt(r->c, pkt, pkt_size);
-
         return 0;
     } else {
         return 1;
     }
 }
 
-// Identifies timed-out packets for a connection
-// and updates the latest_seqno_snapshot.
-void resend (rel_t* r) {
-    r->next_timeout -= r->timer; // Count down.
+// Points two iovecs at the header and the payload of a slot's packet.
+void slot_iov (struct slot* slot, struct iovec* iov) {
+    iov[0].iov_base = slot->pkt;
+    iov[0].iov_len = 12;
+    iov[1].iov_base = (void*) slot->data;
+    iov[1].iov_len = get_size(slot->pkt) - 12;
+}
 
-    // Check if timeouts are possible.
-    if (r->next_timeout <= 0 && r->pkt_buf->count > 0) {
-        packet_t* next_pkt;
-        int i;
+// Sends n consecutive packets of the send buffer, starting at slot first.
+void send_slots (rel_t* r, uint32_t first, size_t n) {
+    size_t i;
 
-        // Iterate through all packets in the buffer.
-        for (i = 0; i < r->pkt_buf->count; i++) {
-            next_pkt = &(r->pkt_buf->buffer[r->pkt_buf->reader + i]);
+    for (i = 0; i < n; i++) {
+        struct slot* slot = &(r->pkt_buf->buffer[(first + i) % r->pkt_buf->size]);
 
-            if (get_seqno(next_pkt) <= r->latest_seqno_snapshot) {
-                fprintf(stderr, "[RE-SEND] %u\n", get_seqno(next_pkt));
-                conn_sendpkt(r->c, next_pkt, get_size(next_pkt));
+        // Every data packet acknowledges what we have received so far.
+        set_ackno(slot->pkt, htonl(r->next_ackno));
+        slot_iov(slot, &(r->send_iov[2 * i]));
+    }
+
+    conn_sendpktsv(r->c, r->send_iov, n, 2);
+    r->unacked = 0;
+}
+
+// Arms the connection timer for the packet that will time out next.
+// That is always the oldest one, only it is ever retransmitted,
+// so this doesn't depend on the size of the window.
+void schedule_timer (rel_t* r) {
+    struct slot* oldest = &(r->pkt_buf->buffer[r->pkt_buf->reader]);
+    struct timespec now;
+    long next = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (r->pkt_buf->count > 0) {
+        next = r->rto - elapsed_ms(&oldest->sent, &now);
+
+        if (next < 0) {
+            next = 0;
+        }
+    }
+
+    // So does a delayed ACK.
+    if (r->unacked > 0) {
+        long left = r->ack_delay - elapsed_ms(&r->ack_since, &now);
+
+        if (left < 0) {
+            left = 0;
+        }
+        if (next < 0 || left < next) {
+            next = left;
+        }
+    }
+
+    // A held back partial packet has to go out once the cork expires.
+    if (r->tail_len > 0 && r->cork > 0) {
+        long left = r->cork - elapsed_ms(&r->tail_since, &now);
+
+        if (left < 0) {
+            left = 0;
+        }
+        if (next < 0 || left < next) {
+            next = left;
+        }
+    }
+
+    conn_settimer(r->c, next);
+}
+
+// Retransmits the oldest unacknowledged packet, once it has not been
+// acknowledged within the timeout since it was last sent. ACKs are
+// cumulative, so the later packets are only resent if they still time
+// out after the ACK for the oldest one moved the window, and a single
+// loss doesn't resend the whole window (go-back-N).
+// Returns 1 if the peer stopped responding and the session was destroyed.
+int resend (rel_t* r) {
+    struct slot* oldest = &(r->pkt_buf->buffer[r->pkt_buf->reader]);
+    struct timespec now;
+
+    if (r->pkt_buf->count == 0) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (elapsed_ms(&oldest->sent, &now) < r->rto) {
+        return 0;
+    }
+
+    // Only give up on a peer that went silent. One that is merely out of
+    // output space still answers our retransmissions, with the same ackno.
+    if (r->max_retries > 0 && r->silent >= r->max_retries) {
+        fprintf(stderr, "[no response after %d retransmissions, giving up]\n", r->silent);
+        if (r->single_connection) {
+            exit(1);
+        }
+        rel_destroy(r);
+        return 1;
+    }
+
+    if (opt_debug) {
+        fprintf(stderr, "[RE-SEND] %u\n", get_seqno(oldest->pkt));
+    }
+    set_ackno(oldest->pkt, htonl(r->next_ackno));
+    slot_iov(oldest, r->send_iov);
+    conn_sendpktsv(r->c, r->send_iov, 1, 2);
+    r->unacked = 0;
+
+    oldest->sent = now;
+    oldest->retries++;
+    r->silent++;
+
+    // Back off exponentially until the next valid RTT sample.
+    r->rto = r->rto * 2 < RTO_MAX ? r->rto * 2 : RTO_MAX;
+
+    return 0;
+}
+
+
+// Acknowledges all packets up to (excluding) next_ackno.
+void ack_pkt (rel_t* r) {
+    uint32_t ackno = htonl(r->next_ackno);
+    struct ack_packet ack;
+
+    ack.cksum  = 0;
+    ack.ackno  = ackno;
+    ack.len    = htons(8);
+    ack.cksum  = cksum(&ack, 8);
+
+    conn_sendpkt(r->c, (packet_t*) &ack, 8);
+    r->unacked = 0;
+}
+
+// Advances LAR up to the highest seqno ACKed.
+// Returns 1 if this freed space in the send buffer.
+int process_ack (rel_t* r, uint32_t ackno) {
+    packet_t* next_pkt = read_pkt(r->pkt_buf);
+    struct slot* acked = NULL;
+    int retransmitted = 0;
+
+    // Ignore ACKs for data we haven't sent yet, after a wraparound
+    // they would otherwise look like they acknowledge everything.
+    if (seq_lt(r->next_seqno, ackno)) {
+        return 0;
+    }
+
+    // Any ACK shows the peer is still there, even one that doesn't move the window.
+    r->silent = 0;
+
+    while (next_pkt != NULL && seq_lt(get_seqno(next_pkt), ackno)) {
+        // fprintf(stderr, "[ACK] %u\n", get_seqno(next_pkt));
+        acked = &(r->pkt_buf->buffer[r->pkt_buf->reader]);
+        retransmitted |= acked->retries > 0;
+        if (get_seqno(next_pkt) == r->small_seqno) {
+            r->small_unacked = 0;
+        }
+        pop_pkt(r->pkt_buf);
+        next_pkt = read_pkt(r->pkt_buf);
+    }
+
+    // Sample the RTT of the newest packet ACKed, unless any packet it
+    // covers was retransmitted (Karn). We can't tell which copy is being
+    // ACKed then, and the later packets only got ACKed once the
+    // retransmission filled the gap in front of them.
+    if (acked != NULL && !retransmitted) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        update_rto(r, elapsed_us(&acked->sent, &now));
+    }
+
+    // Otherwise, the ACK still shows the path is working again,
+    // so don't keep the timeout backed off (as Linux does).
+    if (acked != NULL && retransmitted) {
+        reset_rto(r);
+    }
+
+    if (acked != NULL) {
+        schedule_timer(r);
+    }
+
+    return acked != NULL;
+}
+
+// Outputs the contiguous run of buffered packets starting at next_ackno,
+// as far as the output has space for them. The rest stays buffered.
+// The payloads are handed to conn_outputv straight from the receive window.
+// Returns the number of packets delivered.
+int deliver_pkts (rel_t* r) {
+    packet_t* next_pkt;
+    int n = 0, i, batch;
+
+    // Gather the payloads that fit, up to the EOF. What conn_outputv
+    // writes out right away frees the space again, so keep going until
+    // the output actually queues up, rel_output is only called then.
+    do {
+        size_t space = conn_bufspace(r->c);
+        size_t bytes = 0;
+
+        for (batch = 0; !r->eof_recvd && batch < r->rcv_buf->size; batch++) {
+            next_pkt = rcv_slot(r->rcv_buf, batch);
+
+            if (next_pkt->len == 0 || get_size(next_pkt) == 12 || bytes + get_size(next_pkt) - 12 > space) {
+                break;
             }
+
+            r->rcv_iov[batch].iov_base = next_pkt->data;
+            r->rcv_iov[batch].iov_len = get_size(next_pkt) - 12;
+            bytes += r->rcv_iov[batch].iov_len;
+        }
+
+        if (batch > 0 && conn_outputv(r->c, r->rcv_iov, batch) < 0) {
+            fprintf(stderr, "There was an error.\n");
+        }
+
+        for (i = 0; i < batch; i++) {
+            r->next_ackno++;
+            rcv_advance(r->rcv_buf);
         }
 
-        // We need the seqno of the packet that was added last.
-        // Because we already iterated through the buffer from oldest -> youngest,
-        // this is already stored in next_pkt.
-        r->latest_seqno_snapshot = get_seqno(next_pkt);
+        n += batch;
+    } while (batch > 0);
 
-        r->next_timeout = r->timeout; // Reset the countdown.
+    // EOF
+    next_pkt = rcv_slot(r->rcv_buf, 0);
+    if (!r->eof_recvd && next_pkt->len != 0 && get_size(next_pkt) == 12) {
+        if (opt_debug) {
+            fprintf(stderr, "Recieved EOF\n");
+        }
+        conn_output(r->c, NULL, 0);
+        r->eof_recvd = 1;
+        r->next_ackno++;
+        rcv_advance(r->rcv_buf);
+        n++;
     }
+
+    return n;
 }
 
+// Returns 1 if the next packet in order is waiting for output space.
+int rcv_blocked (rel_t* r) {
+    return !r->eof_recvd && rcv_slot(r->rcv_buf, 0)->len != 0;
+}
 
-// Acknowledges the recieval of the specified packet.
-void ack_pkt (rel_t* r, packet_t* pkt) {
-    uint32_t ackno = htonl(++r->next_ackno);
+// Destroys the connection once both directions are finished.
+// Returns 1 if the connection was destroyed.
+int try_destroy (rel_t* r) {
+    if (r->read_error && r->eof_recvd && (r->pkt_buf->count == 0)) {
+        rel_destroy(r);
+        return 1;
+    }
 
-    if ((r->pkt_buf->count == 0)) {
-        // No outgoing packets, simply go ahead and send it.
-        struct ack_packet* ack = (struct ack_packet*) xmalloc(sizeof(struct ack_packet));
+    return 0;
+}
 
-        ack->cksum  = 0;
-        ack->ackno  = ackno;
-        ack->len    = htons(8);
-        ack->cksum  = cksum(ack, 8);
+// Decides whether the partial packet of held back input should wait
+// for more data, because an earlier partial packet is still in flight.
+// Returns 1 if it should be held back.
+int hold_tail (rel_t* r) {
+    struct timespec now;
 
-        conn_sendpkt(r->c, (packet_t*) ack, 8);
-    } else {
-        // Buffer full.
-        // Piggyback off of the next outgoing packet.
-        packet_t* pkt_out = &(r->pkt_buf->buffer[r->pkt_buf->writer - 1]);
+    if (!r->nagle || r->input_eof || !r->small_unacked) {
+        return 0;
+    }
 
-        pkt_out->ackno = ackno;
-        pkt_out->cksum = cksum(pkt_out, get_size(pkt_out));
+    if (r->cork > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ms(&r->tail_since, &now) >= r->cork) {
+            return 0;
+        }
     }
+
+    return 1;
+}
+
+
+// Frees the packet buffers of a session, some of which might be missing
+// if rel_create ran out of memory.
+void free_bufs (rel_t* r) {
+    free(r->pkt_buf->buffer);
+    free(r->pkt_buf->store);
+    free(r->pkt_buf);
+    free(r->rcv_buf->buffer);
+    free(r->rcv_buf);
+    free(r->send_iov);
+    free(r->rcv_iov);
 }
 
 
 // [LOGIC]
 
 // Creates a new reliable protocol session,
-// returns NULL on failure. ss is always NULL. */
-rel_t* rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct config_common *cc) {
+// returns NULL on failure. In server mode c is NULL and ss is the
+// address of the peer, the connection is created for it here.
+// The session is linked into the list of its event loop. */
+rel_t* rel_create (loop_t *loop, conn_t *c, const struct sockaddr_storage *ss, const struct config_common *cc) {
     rel_t *r;
+    rel_t **rel_list = loop_rels(loop);
+    int created = !c;
+    int i;
+
+    // Config sanity checks, before anything needs to be cleaned up.
+    if (cc->window < 1) {
+        fprintf(stderr, "Window must at least be 1.\n");
+        return NULL;
+    }
+
+    if (cc->window > WINDOW_MAX) {
+        fprintf(stderr, "Window must at most be %d.\n", WINDOW_MAX);
+        return NULL;
+    }
 
     r = xmalloc (sizeof (*r));
     memset (r, 0, sizeof (*r));
 
     if (!c) {
-        c = conn_create (r, ss);
+        c = conn_create (loop, r, ss);
         if (!c) {
             free (r);
             return NULL;
@@ -229,37 +626,83 @@ rel_t* rel_create (conn_t *c, const struct sockaddr_storage *ss, const struct co
     }
 
     r->c = c;
-    r->next = rel_list;
-    r->prev = &rel_list;
-    if (rel_list)
-    rel_list->prev = &r->next;
-    rel_list = r;
-
-    // Config sanity checks.
-    if (cc->window < 1) {
-        fprintf(stderr, "Window must at least be 1.\n");
-        exit(1);
-    }
 
     // Initialize sender / reciever state.
     r->next_seqno = 1;
     r->next_ackno = 1;
 
-    // Initialize timeout detection.
-    r->latest_seqno_snapshot = 0;
-    r->timer = cc->timer;
+    // Initialize timeout detection, the configured timeout
+    // is used until the first RTT has been measured.
+    r->srtt = 0;
+    r->rttvar = 0;
     r->timeout = cc->timeout;
-    r->next_timeout = cc->timeout;
+    r->rto = cc->timeout;
+    r->max_retries = cc->max_retries;
+    r->single_connection = cc->single_connection;
+
+    r->nagle = cc->nagle;
+    r->cork = cc->cork;
+
+    // ACK at least once per window, or the sender stalls until its timeout.
+    r->ack_every = cc->ack_every < cc->window ? cc->ack_every : cc->window;
+    // A longer delay would have the sender time out before our ACK arrives.
+    r->ack_delay = cc->ack_delay < ACK_DELAY_MAX ? cc->ack_delay : ACK_DELAY_MAX;
 
     // Initialize the buffers
     r->pkt_buf = (struct ringbuf*) xmalloc(sizeof(struct ringbuf));
     r->pkt_buf->writer = 0;
     r->pkt_buf->reader = 0;
+    r->pkt_buf->count = 0;
     r->pkt_buf->size = cc->window;
-    r->pkt_buf->buffer = (packet_t*) calloc(cc->window, sizeof(packet_t));
+    r->pkt_buf->buffer = (struct slot*) calloc(cc->window, sizeof(struct slot));
+    r->pkt_buf->store = NULL;
+
+    // Payloads are sent straight out of the input file if it can be mapped,
+    // then the slots only need room for the headers.
+    r->map = conn_inputmap(c, &r->map_len);
+    r->map_off = 0;
+
+    size_t stride = r->map != NULL ? offsetof(packet_t, data) : sizeof(packet_t);
+    if (r->pkt_buf->buffer != NULL) {
+        r->pkt_buf->store = (char*) calloc(cc->window, stride);
+    }
+
+    r->rcv_buf = (struct rcvbuf*) xmalloc(sizeof(struct rcvbuf));
+    r->rcv_buf->head = 0;
+    r->rcv_buf->size = cc->window;
+    r->rcv_buf->buffer = (packet_t*) calloc(cc->window, sizeof(packet_t));
+
+    r->send_iov = (struct iovec*) calloc(2 * cc->window, sizeof(struct iovec));
+    r->rcv_iov = (struct iovec*) calloc(cc->window, sizeof(struct iovec));
+
+    // Large windows might not fit into memory, give up on the session then.
+    if (r->pkt_buf->store == NULL || r->rcv_buf->buffer == NULL || r->send_iov == NULL || r->rcv_iov == NULL) {
+        fprintf(stderr, "Out of memory for a window of %d packets.\n", cc->window);
+        free_bufs(r);
+        free(r);
+
+        // A connection we were given is the caller's to clean up.
+        if (created) {
+            conn_destroy(c);
+        }
+        return NULL;
+    }
+
+    for (i = 0; i < cc->window; i++) {
+        r->pkt_buf->buffer[i].pkt = (packet_t*) (r->pkt_buf->store + i * stride);
+        r->pkt_buf->buffer[i].data = r->map != NULL ? r->map : r->pkt_buf->buffer[i].pkt->data;
+    }
+
+    r->next = *rel_list;
+    r->prev = rel_list;
+    if (*rel_list)
+    (*rel_list)->prev = &r->next;
+    *rel_list = r;
 
     // Initialize state flags
+    r->input_eof = 0;
     r->read_error = 0;
+    r->eof_recvd = 0;
 
     return r;
 }
@@ -273,97 +716,211 @@ void rel_destroy (rel_t *r) {
     *r->prev = r->next;
     conn_destroy (r->c);
 
-    // @TODO: This causes a segfault at the moment.
-
-    // Free packet contents, buffer space
-    // and finally the buffer struct itself.
-    // size_t i;
-    // for (i = 0; i < r->pkt_buf->size; i++) {
-    //     free(r->pkt_buf->buffer[i].data);
-    // }
-    // free(r->pkt_buf->buffer);
-    // free(r->pkt_buf);
+    // Free the packet buffers and finally the state itself.
+    free_bufs(r);
+    free(r);
 }
 
 // Called whenever we have recieved a packet.
 void rel_recvpkt (rel_t *r, packet_t *pkt, size_t n) {
-    // Transform back to host ordering.
-    pkt->ackno  = ntohl(pkt->ackno);
+    size_t size = get_size(pkt);
+
+    // Don't trust a length we didn't actually receive.
+    if (size < 8 || size > n || size > sizeof(packet_t)) {
+        return;
+    }
+
+    // Data packets carry a cumulative ackno as well.
+    int acked = process_ack(r, ntohl(pkt->ackno));
 
     // Check if we're dealing with an ACK.
-    if (get_size(pkt) == 8) {
-        // Advance LAR up to the highest seqno ACKed.
-        packet_t* next_pkt = read_pkt(r->pkt_buf);
-
-        while (next_pkt != NULL && get_seqno(next_pkt) < pkt->ackno) {
-            // fprintf(stderr, "[ACK] %u\n", get_seqno(next_pkt));
-            pop_pkt(r->pkt_buf);
-            next_pkt = read_pkt(r->pkt_buf);
+    if (size == 8) {
+        if (try_destroy(r)) {
+            return;
         }
 
         // Buffer has space now, read remaining inputs.
         rel_read(r);
+        return;
+    }
+
+    // Position of the packet in the receive window.
+    // Old duplicates wrap around to a large offset, the unsigned
+    // difference is also correct across a seqno wraparound.
+    uint32_t offset = get_seqno(pkt) - r->next_ackno;
 
-    } else if (get_size(pkt) == 12) {
-        // EOF
-        fprintf(stderr, "Recieved EOF\n");
+    int delivered = 0;
+    int duplicate = 1;
 
-        conn_output(r->c, pkt->data, 0);
+    if (offset < r->rcv_buf->size) {
+        packet_t* slot = rcv_slot(r->rcv_buf, offset);
 
-        if (r->read_error && (r->pkt_buf->count == 0)) {
-            rel_destroy(r);
+        if (slot->len == 0) {
+            memcpy(slot, pkt, size);
+            duplicate = 0;
         }
 
-    } else {
-        // Send ACK.
-        ack_pkt(r, pkt);
+        delivered = deliver_pkts(r);
+    }
 
-        // Output payload.
-        int bytes_outputted = conn_output(r->c, pkt->data, (get_size(pkt) - 12));
-        if (bytes_outputted < 0) {
-            fprintf(stderr, "There was an error.\n");
+    // Acknowledge immediately if the packet was out of order or a duplicate,
+    // our previous ACK might have been lost or the sender needs to learn
+    // about the gap. The same goes for filling a gap and for the EOF.
+    // Otherwise, wait for more packets to acknowledge them together.
+    // While the output is full, ACKs are withheld until rel_output,
+    // so the sender backs off until we reopen the window. Its
+    // retransmissions are still answered, the ACK doesn't move the
+    // window but tells the sender we're alive.
+    if (!rcv_blocked(r)) {
+        if (delivered != 1 || r->eof_recvd || ++r->unacked >= r->ack_every) {
+            ack_pkt(r);
+        } else if (r->unacked == 1) {
+            clock_gettime(CLOCK_MONOTONIC, &r->ack_since);
+            schedule_timer(r);
         }
+    } else if (duplicate) {
+        ack_pkt(r);
     }
 
+    if (try_destroy(r)) {
+        return;
+    }
+
+    // The piggybacked ACK might have opened the window as well.
+    if (acked) {
+        rel_read(r);
+    }
 }
 
 // Called once we are supposed to send some data over a connection.
 void rel_read (rel_t *s) {
-    void* inp_buf = xmalloc(PAYLOAD_SIZE);
+    struct ringbuf* buf = s->pkt_buf;
+    uint32_t first = buf->writer;
+    size_t queued = 0;
+    int held = s->tail_len;
+
+    // Mapped input is cut into slices in place, the file is read once it's sent.
+    while (s->map != NULL && !s->input_eof && buf_space(buf) > 0) {
+        size_t len = s->map_len - s->map_off < PAYLOAD_SIZE ? s->map_len - s->map_off : PAYLOAD_SIZE;
+
+        free_slot(buf)->data = s->map + s->map_off;
+        s->map_off += len;
+        ingest_pkt(s, len);
+        queued++;
+
+        if (s->map_off == s->map_len) {
+            s->input_eof = 1;
+            if (opt_debug) {
+                fprintf(stderr, "[EOF]\n");
+            }
+        }
+    }
 
-    if (buf_space(s->pkt_buf) > 0) {
-        // Read a single packet into the current window.
-        int bytes_read = conn_input(s->c, inp_buf, PAYLOAD_SIZE);
+    // Fill the whole window in one go, reading straight into the
+    // payloads of the free slots. send_iov doubles as the readv
+    // vector, send_slots overwrites it with the packets afterwards.
+    while (!s->input_eof && buf_space(buf) > 0) {
+        size_t i, n = buf_space(buf);
+
+        if (n > READV_MAX) {
+            n = READV_MAX;
+        }
+        for (i = 0; i < n; i++) {
+            s->send_iov[i].iov_base = buf->buffer[(buf->writer + i) % buf->size].pkt->data;
+            s->send_iov[i].iov_len = PAYLOAD_SIZE;
+        }
+
+        // Held back input is continued where it left off.
+        s->send_iov[0].iov_base = (char*) s->send_iov[0].iov_base + s->tail_len;
+        s->send_iov[0].iov_len -= s->tail_len;
+
+        int bytes_read = conn_inputv(s->c, s->send_iov, n);
+        int short_read = bytes_read < (int) (n * PAYLOAD_SIZE) - s->tail_len;
 
-        s->read_error = 0;
         if (bytes_read == -1) {
-            s->read_error = 1;
-            fprintf(stderr, "[EOF]\n");
-        } else if (bytes_read == 0) {
-            return;
+            s->input_eof = 1;
+            if (opt_debug) {
+                fprintf(stderr, "[EOF]\n");
+            }
+            break;
         }
 
-        ingest_pkt(s, inp_buf, bytes_read);
+        // Full slots go out, a short read leaves a partial one at the end.
+        s->tail_len += bytes_read;
+        for (; s->tail_len >= PAYLOAD_SIZE; s->tail_len -= PAYLOAD_SIZE) {
+            ingest_pkt(s, PAYLOAD_SIZE);
+            queued++;
+        }
+
+        // The input is drained for now, wait for it to become readable.
+        if (short_read) {
+            break;
+        }
+    }
+
+    // Send the partial packet, unless it should wait for more input.
+    if (s->tail_len > 0) {
+        if (held == 0 || queued > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &s->tail_since);
+        }
+
+        if (!hold_tail(s)) {
+            ingest_pkt(s, s->tail_len);
+            s->tail_len = 0;
+            queued++;
+        } else if (held == 0 && s->cork > 0) {
+            schedule_timer(s);
+        }
+    }
+
+    // EOF goes into the next free slot once all input is queued, as an empty packet.
+    if (s->input_eof && !s->read_error && s->tail_len == 0 && buf_space(buf) > 0) {
+        s->read_error = 1;
+        ingest_pkt(s, -1);
+        queued++;
+    }
+
+    if (queued > 0) {
+        send_slots(s, first, queued);
     }
 }
 
 // Called whenever output space becomes available.
 void rel_output (rel_t *r) {
-    size_t bytes_available = conn_bufspace(r->c);
-    fprintf(stderr, "\t -> Can now output %lu more bytes.", bytes_available);
+    // Nothing was held back for lack of space.
+    if (!rcv_blocked(r)) {
+        return;
+    }
 
-    // @TODO
+    // Flush what fits now and tell the sender the window is open again.
+    if (deliver_pkts(r) > 0) {
+        ack_pkt(r);
+        try_destroy(r);
+    }
 }
 
-// Calls resend on every active connection.
-void rel_timer () {
+// Called when the retransmission timer of a connection expires.
+void rel_timer (rel_t *r) {
     // fprintf(stderr, "\t -> [TIMER] \n");
 
-    if (rel_list) {
-        rel_t* r = rel_list;
-        while (r != NULL) {
-            resend(r);
-            r = r->next;
+    if (resend(r)) {
+        return;
+    }
+
+    // Acknowledge packets whose ACK has been delayed long enough.
+    if (r->unacked > 0) {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (elapsed_ms(&r->ack_since, &now) >= r->ack_delay) {
+            ack_pkt(r);
         }
     }
+
+    // The cork of a held back partial packet might have expired.
+    if (r->tail_len > 0) {
+        rel_read(r);
+    }
+
+    schedule_timer(r);
 }
@@ -1,5 +1,7 @@
 /* rlib version 5 */
 
+#define _GNU_SOURCE 1		/* recvmmsg */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -8,18 +10,35 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
-#include <getopt.h>
 #include <assert.h>
 #include <stddef.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
-#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <linux/filter.h>
+
+#if defined (__linux__) && defined (__has_include)
+# if __has_include (<linux/io_uring.h>)
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+#if HAVE_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif /* HAVE_IO_URING */
 
 #include "rlib.h"
 
-char *progname;
+char *progname = "reliable";
 int opt_debug;
 int log_in = -1;
 int log_out = -1;
@@ -32,25 +51,71 @@ struct config_server {
     address */
 };
 
-static struct config_server *serverconf;
+static void conn_mkevents (loop_t *l);
+static int debug_recvmmsg (loop_t *l, int s, int flags, int from);
+static packet_t *rxbatch_pkt (loop_t *l, int i, int j, int *len);
+
+/* An fd registered with the epoll backend */
+struct evsrc {
+    conn_t *conn;
+    int fd;			/* -1 if not registered */
+    uint32_t events;		/* interest currently registered */
+    char always;		/* fd can't be epolled (regular file) */
+    struct evsrc *next;		/* list of always-ready sources */
+};
+
+int opt_epoll;
+int opt_uring;
+
+/* Datagrams are received in batches of up to opt_batch packets */
+int opt_batch = 32;
+struct rxbatch {
+    char *bufs;			/* opt_batch buffers of bufsize bytes */
+    size_t bufsize;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_storage *from;
+    char *cmsgs;		/* GRO segment sizes */
+    char gro;			/* socket coalesces, ask for segment sizes */
+    packet_t aligned;		/* copy of an unaligned packet */
+};
+
+/* Coalesce runs of full-size packets with UDP GSO/GRO */
+int opt_gso;
+#define GSO_MAXSEGS 64
+#define GRO_BUFSIZE 65536
+#define GSO_CMSGSPACE CMSG_SPACE (sizeof (uint16_t))
+#define GRO_CMSGSPACE CMSG_SPACE (sizeof (int))
+
+/* Capacity of each connection's output ring */
+size_t opt_outbuf = 8192;
 
-static void conn_mkevents (void);
-static int debug_recv (int s, packet_t *buf, size_t len, int flags,
-struct sockaddr_storage *from);
+/* Map regular input files instead of reading them */
+int opt_mmap;
 
-int cevents_generation;
-static struct pollfd *cevents;
-static int ncevents;
-static conn_t **evreaders;
-static conn_t **evwriters;
+/* Reasons a received datagram is discarded before reaching rel_recvpkt */
+enum { DROP_TRUNC, DROP_LEN, DROP_CKSUM, NDROPS };
+static const char *const drop_names[NDROPS] = {
+    "truncated", "bad length", "bad checksum"
+};
 
-struct chunk {
-    struct chunk *next;
-    size_t size;
-    size_t used;
-    char buf[1];
+/* The in-memory stream of a connection opened with rel_open.  The
+ * application's rel_send fills inq, which conn_input drains, and
+ * rel_recv drains the connection's output ring. */
+struct memio {
+    struct rel_callbacks cb;
+    void *arg;
+    char *inq;			/* ring of input not yet read by reliable */
+    size_t inhead;
+    size_t inlen;
+    char in_eof;		/* rel_shutdown was called */
+    char closed;		/* rel_close was called */
+    int pending;		/* MEM_* events not yet dispatched */
+    conn_t *next_ready;		/* list of connections with pending events */
 };
-typedef struct chunk chunk_t;
+
+/* Events of in-memory connections, dispatched by the loop */
+enum { MEM_INPUT = 1, MEM_DRAINED = 2, MEM_READABLE = 4, MEM_WRITABLE = 8 };
 
 struct conn {
     rel_t *rel;			/* Data from reliable */
@@ -59,26 +124,121 @@ struct conn {
     int wpoll;
     int npoll;
 
+    struct evsrc rsrc;		/* epoll registrations, if rfd == wfd */
+    struct evsrc wsrc;		/* only rsrc is used */
+    struct evsrc nsrc;
+
+    struct uring_rx **rx;	/* receive buffers posted to io_uring */
+    struct memio *mem;		/* in-memory stream, or NULL */
+
     int rfd;			/* input file descriptor */
     int wfd;			/* output file descriptor */
     int nfd;			/* network file descriptor */
     char server;			/* non-zero on server */
     struct sockaddr_storage peer;	/* network peer */
+    unsigned int peerhash;	/* addrhash (&peer), on server */
 
     char read_eof;	        /* zero if haven't received EOF */
     char write_eof;		/* send EOF when output queue drained */
     char write_err;	        /* zero if it's okay to write to wfd */
     char xoff;			/* non-zero to pause reading */
     char delete_me;		/* delete after draining */
-    chunk_t *outq;		/* chunks not yet written */
-    chunk_t **outqtail;
+    const char *inmap;		/* input file mapping, or NULL */
+    size_t inmaplen;
 
+    char *outq;			/* ring of output not yet written */
+    size_t outhead;		/* offset of the oldest byte in outq */
+    size_t outlen;		/* bytes in outq */
+
+    unsigned long drops[NDROPS];	/* invalid packets, by reason */
+
+    int timer_idx;		/* position in timer heap + 1, 0 if unset */
+    struct timespec deadline;	/* when to call rel_timer */
+
+    loop_t *loop;		/* loop serving this connection */
     struct conn *next;		/* Linked list of connections */
     struct conn **prev;
 };
 
-static conn_t *conn_list;
-struct timespec last_timeout;
+/* Server connections by peer address.  Open addressing with linear
+ * probing, kept at most half full so lookups take a probe or two. */
+struct peertab {
+    conn_t **slots;
+    size_t size;			/* power of two, or 0 */
+    size_t count;
+};
+
+#if HAVE_IO_URING
+#define URING_ENTRIES 512
+#define URING_TXBUFS 256
+#define URING_RXBUFS 32
+
+struct uring_tx {
+    packet_t pkt;
+    size_t len;
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage peer;
+    struct uring_tx *next;	/* free list */
+};
+
+struct uring_rx {
+    packet_t pkt;
+    conn_t *conn;		/* NULL once cancelled */
+    char posted;		/* receive is in flight */
+};
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned pending;		/* SQEs not yet submitted */
+    struct uring_tx tx[URING_TXBUFS];
+    struct uring_tx *txfree;
+};
+#endif /* HAVE_IO_URING */
+
+/* An event loop, with the connections it serves and the state of its
+ * event backend.  Loops share nothing but the options, so several can
+ * run in the threads of one process without any locking.  The lock
+ * only lets other threads use the in-memory connections of a loop,
+ * the loop holds it except while it waits. */
+struct loop {
+    conn_t *conns;		/* Linked list of connections */
+    rel_t *rels;		/* reliable's list of sessions */
+    struct config_server *server;	/* non-NULL on server */
+
+    int cevents_generation;	/* poll backend */
+    int last_cg;
+    struct pollfd *cevents;
+    int ncevents;
+    conn_t **evreaders;
+    conn_t **evwriters;
+
+    int epfd;			/* epoll instance, -1 for the poll backend */
+    struct evsrc *ep_always;
+
+    int ndeletes;		/* connections waiting to be freed */
+    conn_t *ready;		/* in-memory connections with pending events */
+    struct rxbatch rxb;
+    struct peertab peers;
+    char gso;			/* send with GSO, until the kernel refuses */
+
+    pthread_mutex_t lock;	/* recursive, for the callbacks */
+    int wakefd;			/* eventfd that interrupts the wait */
+    char waiting;		/* the lock is released for the wait */
+
+    /* Min-heap of connections with a pending timer, ordered by deadline */
+    conn_t **timers;
+    int ntimers;
+    int maxtimers;
+
+#if HAVE_IO_URING
+    struct uring uring;
+#endif /* HAVE_IO_URING */
+};
 
 #if !DMALLOC
 void *
@@ -118,10 +278,8 @@ clock_gettime (int id, struct timespec *tp)
 void
 print_pkt (const packet_t *buf, const char *op, int n)
 {
-    static int pid = -1;
+    int pid = getpid ();		/* not cached, the server's threads share this */
     int saved_errno = errno;
-    if (pid == -1)
-        pid = getpid ();
     if (n < 0) {
         if (errno != EAGAIN)
             fprintf (stderr, "%5d %s(%3d): %s\n", pid, op, n, strerror (errno));
@@ -139,11 +297,494 @@ print_pkt (const packet_t *buf, const char *op, int n)
     errno = saved_errno;
 }
 
+/* Returns the length of an intact packet in a datagram of n bytes,
+ * or -1 and the reason to drop it in *why.  Packets whose length field
+ * disagrees with the datagram or whose checksum doesn't verify are
+ * damaged. */
+static int
+pkt_check (packet_t *pkt, int n, int *why)
+{
+    int len;
+
+    if (n < 8) {
+        *why = DROP_TRUNC;
+        return -1;
+    }
+    len = ntohs (pkt->len);
+    if (len < 8 || (len > 8 && len < 12) || len > sizeof (*pkt)) {
+        *why = DROP_LEN;
+        return -1;
+    }
+    if (len > n) {
+        *why = DROP_TRUNC;
+        return -1;
+    }
+    /* Summing the stored checksum along with the data yields 0xffff */
+    if (cksum (pkt, len) != 0xffff) {
+        *why = DROP_CKSUM;
+        return -1;
+    }
+    return len;
+}
+
+/* Hands a received datagram to reliable, unless it is damaged.
+ * Damaged packets are counted and dropped here, so rel_recvpkt only
+ * ever sees intact packets without padding. */
+static void
+conn_recvpkt (conn_t *c, packet_t *pkt, int n)
+{
+    int len, why;
+
+    if ((len = pkt_check (pkt, n, &why)) < 0) {
+        c->drops[why]++;
+        return;
+    }
+    rel_recvpkt (c->rel, pkt, len);
+}
+
+static void
+conn_peer_dead (conn_t *c, const struct config_common *cc)
+{
+    char addr[NI_MAXHOST] = "unknown";
+    char port[NI_MAXSERV] = "unknown";
+    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
+    addr, sizeof (addr), port, sizeof (port),
+    NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
+    fprintf (stderr, "[received ICMP port unreachable;"
+    " assuming peer at %s:%s is dead]\n", addr, port);
+    if (cc->single_connection)
+    exit (1);
+    rel_destroy (c->rel);
+}
+
+#if HAVE_IO_URING
+/* io_uring I/O engine.  Outgoing datagrams are copied into a pool of
+ * transmit buffers and queued on the submission ring, which is
+ * flushed with a single io_uring_enter per loop iteration.  Client
+ * connections keep a number of receives posted, whose completions are
+ * reaped after the loop wakes up on the ring fd. */
+
+
+static int
+uring_init (loop_t *l)
+{
+    struct io_uring_params p;
+    size_t sqsize, cqsize;
+    char *sq, *cq;
+    int i;
+
+    memset (&p, 0, sizeof (p));
+    l->uring.fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (l->uring.fd < 0)
+        return -1;
+
+    sqsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsize > sqsize)
+        sqsize = cqsize;
+    sq = mmap (NULL, sqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+               l->uring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto err;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else {
+        cq = mmap (NULL, cqsize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                   l->uring.fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto err;
+    }
+    l->uring.sqes = mmap (NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+                       PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                       l->uring.fd, IORING_OFF_SQES);
+    if (l->uring.sqes == MAP_FAILED)
+        goto err;
+
+    l->uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    l->uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    l->uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    l->uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    l->uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    l->uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    l->uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    l->uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    for (i = 0; i < URING_TXBUFS; i++) {
+        l->uring.tx[i].next = l->uring.txfree;
+        l->uring.txfree = &l->uring.tx[i];
+    }
+    return 0;
+
+ err:
+    close (l->uring.fd);
+    l->uring.fd = -1;
+    return -1;
+}
+
+/* Hand all queued SQEs to the kernel, optionally waiting for a completion */
+static void
+uring_submit (loop_t *l, int wait)
+{
+    if (!l->uring.pending && !wait)
+        return;
+    if (syscall (__NR_io_uring_enter, l->uring.fd, l->uring.pending, wait ? 1 : 0,
+                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0
+            && errno != EINTR) {
+        perror ("io_uring_enter");
+        return;
+    }
+    l->uring.pending = 0;
+}
+
+static struct io_uring_sqe *
+uring_sqe (loop_t *l)
+{
+    unsigned tail = *l->uring.sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n (l->uring.sq_head, __ATOMIC_ACQUIRE)
+            > *l->uring.sq_mask)
+        uring_submit (l, 0);
+
+    sqe = &l->uring.sqes[tail & *l->uring.sq_mask];
+    memset (sqe, 0, sizeof (*sqe));
+    l->uring.sq_array[tail & *l->uring.sq_mask] = tail & *l->uring.sq_mask;
+    return sqe;
+}
+
+static void
+uring_queue (loop_t *l)
+{
+    __atomic_store_n (l->uring.sq_tail, *l->uring.sq_tail + 1, __ATOMIC_RELEASE);
+    l->uring.pending++;
+}
+
+static void
+uring_post_recv (struct uring_rx *rx)
+{
+    loop_t *l = rx->conn->loop;
+    struct io_uring_sqe *sqe = uring_sqe (l);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = rx->conn->nfd;
+    sqe->addr = (uintptr_t) &rx->pkt;
+    sqe->len = sizeof (rx->pkt);
+    sqe->user_data = (uintptr_t) rx | 1;
+    uring_queue (l);
+    rx->posted = 1;
+}
+
+/* Queue a datagram, returns -1 if out of transmit buffers */
+static int
+uring_sendpkt (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    loop_t *l = c->loop;
+    struct io_uring_sqe *sqe;
+    struct uring_tx *tx;
+    size_t len = 0;
+    int i;
+
+    if (!(tx = l->uring.txfree))
+        return -1;
+    l->uring.txfree = tx->next;
+
+    for (i = 0; i < iovcnt; len += iov[i++].iov_len)
+        memcpy ((char *) &tx->pkt + len, iov[i].iov_base, iov[i].iov_len);
+    tx->len = len;
+    tx->iov.iov_base = &tx->pkt;
+    tx->iov.iov_len = len;
+    memset (&tx->msg, 0, sizeof (tx->msg));
+    tx->msg.msg_iov = &tx->iov;
+    tx->msg.msg_iovlen = 1;
+    if (c->server) {
+        tx->peer = c->peer;
+        tx->msg.msg_name = &tx->peer;
+        tx->msg.msg_namelen = addrsize (&c->peer);
+    }
+
+    sqe = uring_sqe (l);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->nfd;
+    sqe->addr = (uintptr_t) &tx->msg;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t) tx;
+    uring_queue (l);
+    return len;
+}
+
+static void
+uring_reap (loop_t *l, const struct config_common *cc)
+{
+    unsigned head;
+
+    /* rel_recvpkt may queue more sends, but never reaps itself */
+    while ((head = *l->uring.cq_head)
+           != __atomic_load_n (l->uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &l->uring.cqes[head & *l->uring.cq_mask];
+        uintptr_t ud = cqe->user_data;
+        int res = cqe->res;
+        struct uring_rx *rx;
+        conn_t *c;
+
+        __atomic_store_n (l->uring.cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (!ud)
+            continue;		/* cancellation */
+        if (!(ud & 1)) {
+            struct uring_tx *tx = (struct uring_tx *) ud;
+            if (res < 0)
+                errno = -res;
+            if (opt_debug)
+                print_pkt (&tx->pkt, "send", res);
+            tx->next = l->uring.txfree;
+            l->uring.txfree = tx;
+            continue;
+        }
+
+        rx = (struct uring_rx *) (ud & ~(uintptr_t) 1);
+        rx->posted = 0;
+        if (!(c = rx->conn)) {
+            free (rx);
+            continue;
+        }
+        if (c->delete_me)
+            continue;		/* freed by uring_detach */
+
+        if (res < 0) {
+            errno = -res;
+            if (opt_debug)
+                print_pkt (&rx->pkt, "recv", res);
+            if (res == -ECONNREFUSED) {
+                conn_peer_dead (c, cc);
+                continue;
+            }
+            if (res != -EAGAIN)
+                perror ("recv");
+        }
+        else {
+            if (opt_debug)
+                print_pkt (&rx->pkt, "recv", res);
+            conn_recvpkt (c, &rx->pkt, res);
+            memset (&rx->pkt, 0xc9, res); /* for debugging */
+        }
+        if (!c->delete_me)
+            uring_post_recv (rx);
+    }
+}
+
+/* Post the receive buffers of a client connection */
+static void
+uring_attach (conn_t *c)
+{
+    int i;
+
+    c->rx = xmalloc (URING_RXBUFS * sizeof (*c->rx));
+    for (i = 0; i < URING_RXBUFS; i++) {
+        c->rx[i] = xmalloc (sizeof (*c->rx[i]));
+        c->rx[i]->conn = c;
+        c->rx[i]->posted = 0;
+        uring_post_recv (c->rx[i]);
+    }
+}
+
+/* Cancel the receives of a connection that is going away, their
+ * buffers are freed as the cancellations complete. */
+static void
+uring_detach (conn_t *c)
+{
+    loop_t *l = c->loop;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    for (i = 0; i < URING_RXBUFS; i++) {
+        if (!c->rx[i]->posted) {
+            free (c->rx[i]);
+            continue;
+        }
+        c->rx[i]->conn = NULL;
+        sqe = uring_sqe (l);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t) c->rx[i] | 1;
+        uring_queue (l);
+    }
+    free (c->rx);
+    c->rx = NULL;
+}
+#endif /* HAVE_IO_URING */
+
+static int
+uring_enabled (loop_t *l)
+{
+#if HAVE_IO_URING
+    return l->uring.fd >= 0;
+#else /* !HAVE_IO_URING */
+    return 0;
+#endif /* !HAVE_IO_URING */
+}
+
+static uint32_t
+evsrc_interest (const struct evsrc *src)
+{
+    const conn_t *c = src->conn;
+    uint32_t ev = 0;
+
+    if (src == &c->nsrc)
+        return EPOLLIN;
+    if (src == &c->rsrc && !c->read_eof && !c->xoff)
+        ev |= EPOLLIN;
+    if ((src == &c->wsrc || c->wfd == c->rfd) && c->outlen && !c->write_err)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+static void
+evsrc_add (conn_t *c, struct evsrc *src, int fd)
+{
+    loop_t *l = c->loop;
+    struct epoll_event ev;
+
+    src->conn = c;
+    src->fd = fd;
+    src->events = evsrc_interest (src);
+    ev.events = src->events;
+    ev.data.ptr = src;
+    if (epoll_ctl (l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (errno != EPERM) {
+            perror ("epoll_ctl");
+            src->fd = -1;
+            return;
+        }
+        /* Regular files are always ready, just like poll reports them */
+        src->always = 1;
+        src->next = l->ep_always;
+        l->ep_always = src;
+    }
+}
+
+static void
+evsrc_del (struct evsrc *src)
+{
+    loop_t *l = src->conn->loop;
+    struct evsrc **sp;
+
+    if (src->fd < 0)
+        return;
+    if (src->always) {
+        for (sp = &l->ep_always; *sp != src; sp = &(*sp)->next)
+            ;
+        *sp = src->next;
+        src->always = 0;
+    }
+    else
+        epoll_ctl (l->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    src->fd = -1;
+}
+
+static void
+evsrc_update (struct evsrc *src)
+{
+    loop_t *l = src->conn->loop;
+    struct epoll_event ev;
+    uint32_t events;
+
+    if (src->fd < 0)
+        return;
+    events = evsrc_interest (src);
+    if (events == src->events)
+        return;
+    src->events = events;
+    if (src->always)
+        return;
+    ev.events = events;
+    ev.data.ptr = src;
+    epoll_ctl (l->epfd, EPOLL_CTL_MOD, src->fd, &ev);
+}
+
+/* Queue events of an in-memory connection for the loop to dispatch */
+static void
+mem_notify (conn_t *c, int events)
+{
+    loop_t *l = c->loop;
+
+    if (!c->mem->pending) {
+        c->mem->next_ready = l->ready;
+        l->ready = c;
+    }
+    c->mem->pending |= events;
+    /* Called from another thread, the loop has to stop waiting */
+    if (l->waiting)
+        loop_wakeup (l);
+}
+
+/* Register a connection's file descriptors with the event backend,
+ * once they have all been set up. */
+static void
+conn_register (conn_t *c)
+{
+    loop_t *l = c->loop;
+#if HAVE_IO_URING
+    if (l->uring.fd >= 0 && !c->server)
+        uring_attach (c);
+#endif /* HAVE_IO_URING */
+    if (l->epfd < 0)
+        return;
+    if (!c->mem)
+        evsrc_add (c, &c->rsrc, c->rfd);
+    if (!c->mem && c->wfd != c->rfd)
+        evsrc_add (c, &c->wsrc, c->wfd);
+    if (!c->server && !c->rx)
+        evsrc_add (c, &c->nsrc, c->nfd);
+}
+
+/* Pause or resume reading from rfd */
+static void
+conn_rwant (conn_t *c, int on)
+{
+    loop_t *l = c->loop;
+    c->xoff = !on;
+    if (l->epfd >= 0)
+        evsrc_update (&c->rsrc);
+    else if (c->rpoll) {
+        if (on)
+            l->cevents[c->rpoll].events |= POLLIN;
+        else
+            l->cevents[c->rpoll].events &= ~POLLIN;
+    }
+}
+
+/* Start or stop waiting for wfd to become writable */
+static void
+conn_wwant (conn_t *c, int on)
+{
+    loop_t *l = c->loop;
+
+    /* In memory, the application reads the output ring itself */
+    if (c->mem) {
+        if (on)
+            mem_notify (c, MEM_READABLE);
+        return;
+    }
+    if (l->epfd >= 0)
+        evsrc_update (c->wfd == c->rfd ? &c->rsrc : &c->wsrc);
+    else if (c->wpoll) {
+        if (on)
+            l->cevents[c->wpoll].events |= POLLOUT;
+        else
+            l->cevents[c->wpoll].events &= ~POLLOUT;
+    }
+}
+
 int
 conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
 {
+    loop_t *l = c->loop;
     int n;
     assert (!c->delete_me);
+#if HAVE_IO_URING
+    struct iovec iov = { (void *) pkt, len };
+    if (l->uring.fd >= 0 && uring_sendpkt (c, &iov, 1) >= 0)
+        return len;
+#endif /* HAVE_IO_URING */
     if (c->server)
         n = sendto (c->nfd, pkt, len, 0,
                     (const struct sockaddr *) &c->peer, addrsize (&c->peer));
@@ -154,34 +795,174 @@ conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len)
     return n;
 }
 
+int
+conn_sendpkts (conn_t *c, const struct iovec *pkts, int npkts)
+{
+    return conn_sendpktsv (c, pkts, npkts, 1);
+}
+
+/* Length of the packet made up of the given pieces */
+static size_t
+iov_total (const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    while (iovcnt-- > 0)
+        len += iov++->iov_len;
+    return len;
+}
+
+int
+conn_sendpktsv (conn_t *c, const struct iovec *iov, int npkts, int iovper)
+{
+    loop_t *l = c->loop;
+    struct mmsghdr msgs[64];
+    int segs[64];
+#ifdef UDP_SEGMENT
+    char cbufs[64][GSO_CMSGSPACE];
+#endif /* UDP_SEGMENT */
+    int i, j, k, m, n, done = 0;
+    assert (!c->delete_me);
+#if HAVE_IO_URING
+    if (l->uring.fd >= 0) {
+        for (i = 0; i < npkts; i++) {
+            const struct iovec *pkt = &iov[i * iovper];
+            if (uring_sendpkt (c, pkt, iovper) < 0) {
+                packet_t buf;
+                size_t len = 0;
+                for (j = 0; j < iovper; len += pkt[j++].iov_len)
+                    memcpy ((char *) &buf + len, pkt[j].iov_base, pkt[j].iov_len);
+                conn_sendpkt (c, &buf, len);
+            }
+        }
+        return npkts;
+    }
+#endif /* HAVE_IO_URING */
+
+    while (done < npkts) {
+        memset (msgs, 0, sizeof (msgs));
+        for (m = 0, i = done; i < npkts && m < 64; m++, i += k) {
+            msgs[m].msg_hdr.msg_iov = (struct iovec *) &iov[i * iovper];
+            if (c->server) {
+                msgs[m].msg_hdr.msg_name = &c->peer;
+                msgs[m].msg_hdr.msg_namelen = addrsize (&c->peer);
+            }
+            k = 1;
+#ifdef UDP_SEGMENT
+            /* Send a run of full-size packets as one datagram for the
+             * kernel to segment, only the last one may be shorter. */
+            while (l->gso && i + k < npkts && k < GSO_MAXSEGS
+                   && iov_total (&iov[(i + k - 1) * iovper], iovper)
+                      == sizeof (packet_t))
+                k++;
+            if (k > 1) {
+                struct cmsghdr *cm;
+                uint16_t segsize = sizeof (packet_t);
+                msgs[m].msg_hdr.msg_control = cbufs[m];
+                msgs[m].msg_hdr.msg_controllen = sizeof (cbufs[m]);
+                cm = CMSG_FIRSTHDR (&msgs[m].msg_hdr);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN (sizeof (segsize));
+                memcpy (CMSG_DATA (cm), &segsize, sizeof (segsize));
+            }
+#endif /* UDP_SEGMENT */
+            msgs[m].msg_hdr.msg_iovlen = k * iovper;
+            segs[m] = k;
+        }
+
+        n = sendmmsg (c->nfd, msgs, m, 0);
+        if (n < 0 && l->gso && segs[0] > 1
+                && (errno == EINVAL || errno == EIO)) {
+            /* Only sending falls back, GRO stays on for receiving */
+            fprintf (stderr, "%s: UDP GSO failed, disabling it\n", progname);
+            l->gso = 0;
+            continue;
+        }
+        if (opt_debug && n < 0)
+            print_pkt (iov[done * iovper].iov_base, "send", n);
+        if (n <= 0)
+            return done ? done : -1;
+        for (i = 0; i < n; i++) {
+            if (opt_debug)
+                for (j = 0; j < segs[i]; j++)
+                    print_pkt (iov[(done + j) * iovper].iov_base, "send",
+                               iov_total (&iov[(done + j) * iovper], iovper));
+            done += segs[i];
+        }
+    }
+    return done;
+}
+
 size_t
 conn_bufspace (conn_t *c)
 {
-    chunk_t *ch;
-    size_t used = 0;
-    const size_t bufsize = 8192;
+    return opt_outbuf - c->outlen;
+}
 
+/* Copies n bytes to the end of a ring of opt_outbuf bytes, which has
+ * room for them */
+static void
+ring_put (char *ring, size_t head, size_t *len, const char *buf, size_t n)
+{
+    size_t tail = (head + *len) % opt_outbuf;
+    size_t first = n < opt_outbuf - tail ? n : opt_outbuf - tail;
 
-    for (ch = c->outq; ch; ch = ch->next)
-        used += (ch->size - ch->used);
-    return used > bufsize ? 0 : bufsize - used;
+    memcpy (ring + tail, buf, first);
+    memcpy (ring, buf + first, n - first);
+    *len += n;
 }
 
-int
-conn_output (conn_t *c, const void *_buf, size_t _n)
+/* Takes up to n bytes off the front of a ring of opt_outbuf bytes,
+ * returns how many */
+static size_t
+ring_get (const char *ring, size_t *head, size_t *len, char *buf, size_t n)
 {
-    const char *buf = _buf;
-    int n = _n;
+    size_t first;
+
+    if (n > *len)
+        n = *len;
+    first = n < opt_outbuf - *head ? n : opt_outbuf - *head;
+    memcpy (buf, ring + *head, first);
+    memcpy (buf + first, ring, n - first);
+    *head = (*head + n) % opt_outbuf;
+    *len -= n;
+    return n;
+}
 
-    assert (!c->delete_me && !c->write_eof);
+static void
+outq_put (conn_t *c, const char *buf, size_t n)
+{
+    ring_put (c->outq, c->outhead, &c->outlen, buf, n);
+}
+
+int
+conn_output (conn_t *c, const void *buf, size_t n)
+{
+    struct iovec iov;
 
     if (n == 0) {
+        assert (!c->delete_me && !c->write_eof);
         c->write_eof = 1;
-        if (!c->outq)
+        if (c->mem)
+            mem_notify (c, MEM_READABLE);
+        else if (!c->outlen)
             shutdown (c->wfd, SHUT_WR);
         return 0;
     }
 
+    iov.iov_base = (void *) buf;
+    iov.iov_len = n;
+    return conn_outputv (c, &iov, 1);
+}
+
+int
+conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    size_t done = 0, pos = 0, accepted = 0, space;
+    int i;
+
+    assert (!c->delete_me && !c->write_eof);
+
     if (c->write_err) {
         if (c->write_err == 2)
             fprintf (stderr, "conn_output: attempt to write after error\n");
@@ -192,11 +973,9 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
     if (!conn_bufspace (c))
         return 0;
 
-    if (log_out >= 0)
-        write (log_out, buf, n);
-
-    if (!c->outq) {
-        int r = write (c->wfd, buf, n);
+    /* Straight from the caller's buffers if nothing is queued */
+    if (!c->outlen && !c->mem) {
+        int r = writev (c->wfd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
         if (r < 0) {
             if (errno != EAGAIN) {
                 perror ("write");
@@ -204,73 +983,394 @@ conn_output (conn_t *c, const void *_buf, size_t _n)
                 return -1;
             }
         }
-        else {
-            buf += r;
-            n -= r;
+        else
+            done = r;
+    }
+
+    /* Queue what didn't go out, as much as fits */
+    space = conn_bufspace (c);
+    for (i = 0; i < iovcnt; pos += iov[i++].iov_len) {
+        const char *base = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        size_t written = done <= pos ? 0 : done - pos < len ? done - pos : len;
+        size_t take = len - written < space ? len - written : space;
+
+        outq_put (c, base + written, take);
+        space -= take;
+        accepted += written + take;
+
+        if (log_out >= 0)
+            write (log_out, base, written + take);
+        if (written + take < len)
+            break;
+    }
+
+    if (c->outlen)
+        conn_wwant (c, 1);
+    return accepted;
+}
+
+/* conn_inputv of an in-memory connection */
+static int
+mem_read (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    struct memio *m = c->mem;
+    size_t n;
+    int i, r = 0;
+
+    for (i = 0; i < iovcnt && m->inlen; i++) {
+        n = ring_get (m->inq, &m->inhead, &m->inlen, iov[i].iov_base,
+                      iov[i].iov_len);
+        r += n;
+    }
+    if (!r && m->in_eof) {
+        errno = EIO;
+        c->read_eof = 1;
+        return -1;
+    }
+    if (r > 0)
+        mem_notify (c, MEM_WRITABLE);
+
+    conn_rwant (c, 1);
+    return r;
+}
+
+int
+conn_input (conn_t *c, void *buf, size_t n)
+{
+    int r;
+    assert (!c->delete_me);
+
+    if (c->read_eof)
+        return -1;
+    if (c->mem) {
+        struct iovec iov = { buf, n };
+        return mem_read (c, &iov, 1);
+    }
+    r = read (c->rfd, buf, n);
+    if (r == 0 || (r < 0 && errno != EAGAIN)) {
+        if (r == 0)
+            errno = EIO;
+        r = -1;
+        c->read_eof = 1;
+        return r;
+    }
+    if (r < 0 && errno == EAGAIN)
+        r = 0;
+
+    if (r > 0 && log_in >= 0)
+        write (log_in, buf, r);
+
+    conn_rwant (c, 1);
+    return r;
+}
+
+int
+conn_inputv (conn_t *c, const struct iovec *iov, int iovcnt)
+{
+    int r;
+    assert (!c->delete_me);
+
+    if (c->read_eof)
+        return -1;
+    if (c->mem)
+        return mem_read (c, iov, iovcnt);
+    if (iovcnt > IOV_MAX)
+        iovcnt = IOV_MAX;
+    r = readv (c->rfd, iov, iovcnt);
+    if (r == 0 || (r < 0 && errno != EAGAIN)) {
+        if (r == 0)
+            errno = EIO;
+        r = -1;
+        c->read_eof = 1;
+        return r;
+    }
+    if (r < 0 && errno == EAGAIN)
+        r = 0;
+
+    if (r > 0 && log_in >= 0) {
+        int i, left = r;
+        for (i = 0; left > 0; i++) {
+            int n = left < iov[i].iov_len ? left : iov[i].iov_len;
+            write (log_in, iov[i].iov_base, n);
+            left -= n;
+        }
+    }
+
+    conn_rwant (c, 1);
+    return r;
+}
+
+const void *
+conn_inputmap (conn_t *c, size_t *len)
+{
+    struct stat sb;
+    off_t off;
+    void *map;
+
+    if (!opt_mmap || c->mem || c->read_eof || fstat (c->rfd, &sb) < 0
+            || !S_ISREG (sb.st_mode)
+            || (off = lseek (c->rfd, 0, SEEK_CUR)) < 0 || off >= sb.st_size)
+        return NULL;
+
+    /* Mappings start on a page, so map all of it and skip what's been read */
+    map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, c->rfd, 0);
+    if (map == MAP_FAILED) {
+        perror ("mmap");
+        return NULL;
+    }
+    madvise (map, sb.st_size, MADV_SEQUENTIAL);
+    c->inmap = map;
+    c->inmaplen = sb.st_size;
+
+    if (log_in >= 0)
+        write (log_in, c->inmap + off, sb.st_size - off);
+
+    *len = sb.st_size - off;
+    return c->inmap + off;
+}
+
+static int
+ts_before (const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec
+        || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void
+timer_place (conn_t *c, int i)
+{
+    loop_t *l = c->loop;
+    l->timers[i] = c;
+    c->timer_idx = i + 1;
+}
+
+/* Restore the heap property for the entry at index i */
+static void
+timer_fix (loop_t *l, int i)
+{
+    conn_t *c = l->timers[i];
+
+    while (i > 0 && ts_before (&c->deadline, &l->timers[(i - 1) / 2]->deadline)) {
+        timer_place (l->timers[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= l->ntimers)
+            break;
+        if (child + 1 < l->ntimers
+                && ts_before (&l->timers[child + 1]->deadline,
+                              &l->timers[child]->deadline))
+            child++;
+        if (!ts_before (&l->timers[child]->deadline, &c->deadline))
+            break;
+        timer_place (l->timers[child], i);
+        i = child;
+    }
+    timer_place (c, i);
+}
+
+static void
+timer_remove (conn_t *c)
+{
+    loop_t *l = c->loop;
+    int i = c->timer_idx - 1;
+
+    if (!c->timer_idx)
+        return;
+    c->timer_idx = 0;
+    if (i != --l->ntimers) {
+        timer_place (l->timers[l->ntimers], i);
+        timer_fix (l, i);
+    }
+}
+
+void
+conn_settimer (conn_t *c, long ms)
+{
+    loop_t *l = c->loop;
+    if (ms < 0) {
+        timer_remove (c);
+        return;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &c->deadline);
+    c->deadline.tv_sec += ms / 1000;
+    c->deadline.tv_nsec += (ms % 1000) * 1000000;
+    if (c->deadline.tv_nsec >= 1000000000) {
+        c->deadline.tv_sec++;
+        c->deadline.tv_nsec -= 1000000000;
+    }
+
+    if (!c->timer_idx) {
+        if (l->ntimers == l->maxtimers) {
+            conn_t **t;
+            l->maxtimers = l->maxtimers ? 2 * l->maxtimers : 16;
+            t = xmalloc (l->maxtimers * sizeof (*t));
+            if (l->ntimers)
+                memcpy (t, l->timers, l->ntimers * sizeof (*t));
+            free (l->timers);
+            l->timers = t;
         }
+        timer_place (c, l->ntimers++);
     }
+    timer_fix (l, c->timer_idx - 1);
+}
+
+/* Milliseconds until the earliest timer expires, -1 if there is none */
+static int
+timer_wait (loop_t *l)
+{
+    struct timespec ts;
+    long long ns;
+
+    if (l->ready)
+        return 0;
+    if (!l->ntimers)
+        return -1;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    ns = (l->timers[0]->deadline.tv_sec - ts.tv_sec) * 1000000000LL
+        + (l->timers[0]->deadline.tv_nsec - ts.tv_nsec);
+    if (ns <= 0)
+        return 0;
+    return (ns + 999999) / 1000000;
+}
+
+/* Call rel_timer for every connection whose deadline has passed */
+static void
+timer_run (loop_t *l)
+{
+    struct timespec ts;
+    conn_t *c;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    while (l->ntimers && !ts_before (&ts, &l->timers[0]->deadline)) {
+        c = l->timers[0];
+        timer_remove (c);
+        if (!c->delete_me)
+            rel_timer (c->rel);
+    }
+}
+
+/* Milliseconds to wait for events, at most ms unless that is -1 */
+static int
+loop_wait_ms (loop_t *l, int ms)
+{
+    int wait = timer_wait (l);
+
+    if (ms >= 0 && (wait < 0 || wait > ms))
+        wait = ms;
+    return wait;
+}
+
+/* Releases the loop to other threads while it waits, and takes it back */
+static void
+loop_release (loop_t *l)
+{
+    l->waiting = 1;
+    pthread_mutex_unlock (&l->lock);
+}
+
+static void
+loop_acquire (loop_t *l)
+{
+    uint64_t n;
+
+    pthread_mutex_lock (&l->lock);
+    l->waiting = 0;
+    /* Wakeups are only needed until the loop is back */
+    while (read (l->wakefd, &n, sizeof (n)) > 0)
+        ;
+}
 
-    if (n > 0) {
-        chunk_t *ch = xmalloc (offsetof (chunk_t, buf[n]));
-        ch->next = NULL;
-        ch->size = n;
-        ch->used = 0;
-        memcpy (ch->buf, buf, n);
-        *c->outqtail = ch;
-        c->outqtail = &ch->next;
-    }
+/* Returns the slot holding the server connection to ss, whose
+ * addrhash is h, or the empty slot where it would go. */
+static conn_t **
+peer_slot (loop_t *l, const struct sockaddr_storage *ss, unsigned int h)
+{
+    size_t mask = l->peers.size - 1;
+    size_t i = h & mask;
+    conn_t *c;
 
-    if (c->wpoll && c->outq)
-    cevents[c->wpoll].events |= POLLOUT;
-    return _n;
+    while ((c = l->peers.slots[i]) && (c->peerhash != h || !addreq (&c->peer, ss)))
+        i = (i + 1) & mask;
+    return &l->peers.slots[i];
 }
 
-int
-conn_input (conn_t *c, void *buf, size_t n)
+static conn_t *
+peer_lookup (loop_t *l, const struct sockaddr_storage *ss)
 {
-    int r;
-    assert (!c->delete_me);
+    if (!l->peers.count)
+        return NULL;
+    return *peer_slot (l, ss, addrhash (ss));
+}
 
-    if (c->read_eof)
-        return -1;
-    r = read (c->rfd, buf, n);
-    if (r == 0 || (r < 0 && errno != EAGAIN)) {
-        if (r == 0)
-            errno = EIO;
-        r = -1;
-        c->read_eof = 1;
-        return r;
+static void
+peer_insert (conn_t *c)
+{
+    loop_t *l = c->loop;
+    if (2 * (l->peers.count + 1) > l->peers.size) {
+        conn_t **old = l->peers.slots;
+        size_t i, oldsize = l->peers.size;
+
+        l->peers.size = oldsize ? 2 * oldsize : 64;
+        l->peers.slots = xmalloc (l->peers.size * sizeof (*l->peers.slots));
+        memset (l->peers.slots, 0, l->peers.size * sizeof (*l->peers.slots));
+        for (i = 0; i < oldsize; i++)
+            if (old[i])
+                *peer_slot (l, &old[i]->peer, old[i]->peerhash) = old[i];
+        free (old);
     }
-    if (r < 0 && errno == EAGAIN)
-        r = 0;
-
-    if (r > 0 && log_in >= 0)
-        write (log_in, buf, r);
+    *peer_slot (l, &c->peer, c->peerhash) = c;
+    l->peers.count++;
+}
 
-    c->xoff = 0;
-    cevents[c->rpoll].events |= POLLIN;
-    return r;
+static void
+peer_remove (conn_t *c)
+{
+    loop_t *l = c->loop;
+    size_t mask = l->peers.size - 1;
+    size_t i, j;
+    conn_t *d;
+
+    for (i = c->peerhash & mask; l->peers.slots[i] != c; i = (i + 1) & mask)
+        ;
+    l->peers.slots[i] = NULL;
+    l->peers.count--;
+
+    /* Shift later entries of the probe run back into the hole, unless
+     * that would move them in front of their home slot. */
+    for (j = (i + 1) & mask; (d = l->peers.slots[j]); j = (j + 1) & mask)
+        if (((j - (d->peerhash & mask)) & mask) >= ((j - i) & mask)) {
+            l->peers.slots[i] = d;
+            l->peers.slots[j] = NULL;
+            i = j;
+        }
 }
 
 static conn_t *
-conn_alloc (void)
+conn_alloc (loop_t *l)
 {
     conn_t *c = xmalloc (sizeof (*c));
     memset (c, 0, sizeof (*c));
-    c->prev = &conn_list;
-    c->next = conn_list;
-    c->outqtail = &c->outq;
-    if (conn_list)
-        conn_list->prev = &c->next;
-    conn_list = c;
-
-    cevents_generation++;
+    c->loop = l;
+    c->prev = &l->conns;
+    c->next = l->conns;
+    c->outq = xmalloc (opt_outbuf);
+    c->rsrc.conn = c->wsrc.conn = c->nsrc.conn = c;
+    c->rsrc.fd = c->wsrc.fd = c->nsrc.fd = -1;
+    if (l->conns)
+        l->conns->prev = &c->next;
+    l->conns = c;
+
+    l->cevents_generation++;
 
     return c;
 }
 
 conn_t *
-conn_create (rel_t *rel, const struct sockaddr_storage *ss)
+conn_create (loop_t *l, rel_t *rel, const struct sockaddr_storage *ss)
 {
     int n;
     conn_t *c;
@@ -278,14 +1378,14 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
     /* conn_create is only when the program is running as a server (and
     * rel_recvpkt is called with NULL packets.  If you call conn_create
     * in the client, you will see this assertion fail. */
-    assert (serverconf);
+    assert (l->server);
 
-    if ((n = connect_to (0, &serverconf->dest)) < 0) {
+    if ((n = connect_to (0, &l->server->dest)) < 0) {
         char addr[NI_MAXHOST] = "unknown";
         char port[NI_MAXSERV] = "unknown";
         int saved_errno = errno;
-        getnameinfo ((const struct sockaddr *) &serverconf->dest,
-                        sizeof (serverconf->dest),
+        getnameinfo ((const struct sockaddr *) &l->server->dest,
+                        sizeof (l->server->dest),
                         addr, sizeof (addr), port, sizeof (port),
                         NI_DGRAM | NI_NUMERICHOST | NI_NUMERICSERV);
         fprintf (stderr, "%s:%s: connect: %s\n",
@@ -293,12 +1393,15 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
         return NULL;
     }
 
-    c = conn_alloc ();
+    c = conn_alloc (l);
     c->peer = *ss;
+    c->peerhash = addrhash (ss);
     c->rel = rel;
-    c->nfd = serverconf->udp_socket;
+    c->nfd = l->server->udp_socket;
     c->rfd = c->wfd = n;
     c->server = 1;
+    peer_insert (c);
+    conn_register (c);
 
     return c;
 }
@@ -306,24 +1409,57 @@ conn_create (rel_t *rel, const struct sockaddr_storage *ss)
 static void
 conn_free (conn_t *c)
 {
-    chunk_t *ch, *nch;
+    loop_t *l = c->loop;
+    int i;
 
-    for (ch = c->outq; ch; ch = nch) {
-        nch = ch->next;
-        free (ch);
+    if (opt_debug)
+        for (i = 0; i < NDROPS; i++)
+            if (c->drops[i])
+                fprintf (stderr, "%s: dropped %lu packets with %s\n",
+                         progname, c->drops[i], drop_names[i]);
+
+    free (c->outq);
+    if (c->mem) {
+        conn_t **rp;
+        if (c->mem->pending) {
+            for (rp = &l->ready; *rp != c; rp = &(*rp)->mem->next_ready)
+                ;
+            *rp = c->mem->next_ready;
+        }
+        free (c->mem->inq);
+        free (c->mem);
     }
 
     if (c->next)
         c->next->prev = c->prev;
     *c->prev = c->next;
 
-    close (c->rfd);
-    if (c->wfd != c->rfd)
+    timer_remove (c);
+#if HAVE_IO_URING
+    if (c->rx)
+        uring_detach (c);
+    /* Sends queued for this connection need the fds still open */
+    if (l->uring.fd >= 0)
+        uring_submit (l, 0);
+#endif /* HAVE_IO_URING */
+    if (l->epfd >= 0) {
+        evsrc_del (&c->rsrc);
+        evsrc_del (&c->wsrc);
+        evsrc_del (&c->nsrc);
+    }
+
+    if (c->inmap)
+        munmap ((void *) c->inmap, c->inmaplen);
+    if (c->rfd >= 0)
+        close (c->rfd);
+    if (c->wfd != c->rfd && c->wfd >= 0)
         close (c->wfd);
-    if (!c->server)
+    if (c->server)
+        peer_remove (c);
+    else
         close (c->nfd);
 
-    cevents_generation++;
+    l->cevents_generation++;
 
     /* to help catch errors */
     memset (c, 0xc5, sizeof (*c));
@@ -333,42 +1469,58 @@ conn_free (conn_t *c)
 void
 conn_destroy (conn_t *c)
 {
+    loop_t *l = c->loop;
+
+    if (!c->delete_me)
+        l->ndeletes++;
     c->delete_me = 1;
+    /* Let the application see that the connection is over */
+    if (c->mem)
+        mem_notify (c, MEM_READABLE | MEM_WRITABLE);
 }
 
 void
 conn_drain (conn_t *c)
 {
-    chunk_t *ch;
+    struct iovec iov[2];
     int didsome = 0;
 
-    if (c->wpoll)
-        cevents[c->wpoll].events &= ~POLLOUT;
+    conn_wwant (c, 0);
 
     if (c->write_err)
         return;
 
-    while ((ch = c->outq)) {
-        int n = write (c->wfd, ch->buf + ch->used,
-        ch->size - ch->used);
+    while (c->outlen) {
+        /* The queued bytes wrap around the end of the ring */
+        int n, iovcnt = 1;
+        iov[0].iov_base = c->outq + c->outhead;
+        iov[0].iov_len = c->outlen;
+        if (c->outhead + c->outlen > opt_outbuf) {
+            iov[0].iov_len = opt_outbuf - c->outhead;
+            iov[1].iov_base = c->outq;
+            iov[1].iov_len = c->outlen - iov[0].iov_len;
+            iovcnt = 2;
+        }
+
+        n = writev (c->wfd, iov, iovcnt);
         if (n < 0) {
             if (errno != EAGAIN)
                 c->write_err = 1;
+            else
+                conn_wwant (c, 1);
             break;
         }
         didsome = 1;
-        ch->used += n;
-        if (ch->used < ch->size) {
-            if (c->wpoll)
-                cevents[c->wpoll].events |= POLLOUT;
+        c->outhead = (c->outhead + n) % opt_outbuf;
+        c->outlen -= n;
+        if (c->outlen) {
+            conn_wwant (c, 1);
             break;
         }
-        c->outq = ch->next;
-        if (!c->outq)
-            c->outqtail = &c->outq;
-        free (ch);
+        /* Keep later writes in one piece */
+        c->outhead = 0;
     }
-    if (c->write_eof && !c->write_err && !c->outq) {
+    if (c->write_eof && !c->write_err && !c->outlen) {
         c->write_err = 1;
         shutdown (c->wfd, SHUT_WR);
     }
@@ -377,15 +1529,17 @@ conn_drain (conn_t *c)
 }
 
 static void
-conn_mkevents (void)
+conn_mkevents (loop_t *l)
 {
     struct pollfd *e;
     conn_t **r, **w;
-    size_t n = 2;
+    size_t n = 4;
     conn_t *c;
 
-    for (c = conn_list; c; c = c->next) {
-        if (c->read_eof) {
+    for (c = l->conns; c; c = c->next) {
+        if (c->mem)
+            c->rpoll = c->wpoll = 0;
+        else if (c->read_eof) {
             c->rpoll = 0;
             if (c->write_err)
                 c->wpoll = 0;
@@ -401,7 +1555,7 @@ conn_mkevents (void)
             else
                 c->wpoll = n++;
         }
-        if (c->server)
+        if (c->server || c->rx)
             c->npoll = 0;
         else
             c->npoll = n++;
@@ -409,13 +1563,17 @@ conn_mkevents (void)
 
     e = xmalloc (n * sizeof (*e));
     memset (e, 0, n * sizeof (*e));
-    if (cevents)
-        e[0] = cevents[0];
+    if (l->cevents)
+        e[0] = l->cevents[0];
     else
         e[0].fd = -1;
     e[1].fd = 2;			/* Do catch errors on stderr */
+    e[2].fd = l->server ? l->server->udp_socket : -1;
+    e[2].events = POLLIN;
+    e[3].fd = l->wakefd;
+    e[3].events = POLLIN;
 
-    for (c = conn_list; c; c = c->next) {
+    for (c = l->conns; c; c = c->next) {
         if (c->rpoll) {
             e[c->rpoll].fd = c->rfd;
             if (!c->xoff)
@@ -423,7 +1581,7 @@ conn_mkevents (void)
         }
         if (c->wpoll) {
             e[c->wpoll].fd = c->wfd;
-            if (c->outq)
+            if (c->outlen)
                 e[c->wpoll].events |= POLLOUT;
         }
         if (c->npoll) {
@@ -436,7 +1594,7 @@ conn_mkevents (void)
     memset (r, 0, n * sizeof (*r));
     w = xmalloc (n * sizeof (*w));
     memset (w, 0, n * sizeof (*w));
-    for (c = conn_list; c; c = c->next) {
+    for (c = l->conns; c; c = c->next) {
         if (c->rpoll > 0)
             r[c->rpoll] = c;
         if (c->npoll > 0)
@@ -445,126 +1603,284 @@ conn_mkevents (void)
             w[c->wpoll] = c;
     }
 
-    free (cevents);
-    cevents = e;
-    ncevents = n;
-    free (evreaders);
-    evreaders = r;
-    free (evwriters);
-    evwriters = w;
+    free (l->cevents);
+    l->cevents = e;
+    l->ncevents = n;
+    free (l->evreaders);
+    l->evreaders = r;
+    free (l->evwriters);
+    l->evwriters = w;
 }
 
-long
-need_timer_in (const struct timespec *last, long timer)
+/* Handle readiness of fd, on which rc reads and/or wc writes */
+static void
+conn_event (conn_t *rc, conn_t *wc, int fd, int revents,
+            const struct config_common *cc)
 {
-    long to;
-    struct timespec ts;
+    conn_t *c;
 
-    clock_gettime (CLOCK_MONOTONIC, &ts);
-    to = ts.tv_sec - last->tv_sec;
-    if (to > timer / 1000)
-        return 0;
-    to = to * 1000 + (ts.tv_nsec - last->tv_nsec) / 1000000;
-    if (to >= timer)
-        return 0;
-    return timer - to;
+    if (revents & (POLLIN|POLLERR|POLLHUP)) {
+        if ((c = rc) && !c->delete_me) {
+            if (fd == c->rfd) {
+                conn_rwant (c, 0);
+                rel_read (c->rel);
+            }
+            else if (fd == c->nfd && (revents & (POLLERR|POLLHUP)))
+                conn_peer_dead (c, cc);
+            else if (fd == c->nfd && !c->server) {
+                loop_t *l = c->loop;
+                int i, j, len, n = debug_recvmmsg (l, c->nfd, 0, 0);
+                packet_t *pkt;
+                if (n < 0) {
+                    if (errno != EAGAIN)
+                        perror ("recvmmsg");
+                }
+                for (i = 0; i < n; i++)
+                    for (j = 0; !c->delete_me
+                             && (pkt = rxbatch_pkt (l, i, j, &len)); j++) {
+                        conn_recvpkt (c, pkt, len);
+                        memset (pkt, 0xc9, len); /* for debugging */
+                    }
+            }
+        }
+    }
+    if ((revents & (POLLOUT|POLLHUP|POLLERR)) && wc)
+        conn_drain (wc);
 }
 
-void
-conn_poll (const struct config_common *cc)
+/* Receive a batch of datagrams on the server socket and hand each to
+ * the connection of its sender.  Only the first data packet of a
+ * stream creates a connection, so stray packets of a session that
+ * has already finished don't start a new one. */
+static void
+server_recv (loop_t *l)
 {
-    int i;
-    conn_t *c, *nc;
-    static int last_cg;
+    int i, j, len, why, n = debug_recvmmsg (l, l->server->udp_socket, 0, 1);
+    packet_t *pkt;
+    conn_t *c;
+
+    if (n < 0 && errno != EAGAIN)
+        perror ("recvmmsg");
+    for (i = 0; i < n; i++) {
+        if (!(c = peer_lookup (l, &l->rxb.from[i]))) {
+            if (!(pkt = rxbatch_pkt (l, i, 0, &len))
+                    || pkt_check (pkt, len, &why) < 12
+                    || ntohl (pkt->seqno) != 1
+                    || !rel_create (l, NULL, &l->rxb.from[i], &l->server->c)
+                    || !(c = peer_lookup (l, &l->rxb.from[i])))
+                continue;
+        }
+        for (j = 0; !c->delete_me && (pkt = rxbatch_pkt (l, i, j, &len)); j++) {
+            conn_recvpkt (c, pkt, len);
+            memset (pkt, 0xc9, len); /* for debugging */
+        }
+    }
+}
+
+static void
+conn_poll_poll (loop_t *l, const struct config_common *cc, int ms)
+{
+    int i, wait;
 
-    if (last_cg != cevents_generation) {
-        conn_mkevents ();
-        cevents_generation = last_cg;
+    if (l->last_cg != l->cevents_generation) {
+        conn_mkevents (l);
+        l->cevents_generation = l->last_cg;
     }
 
-    if (cevents[0].fd >= 0)
-        poll (cevents, ncevents, need_timer_in (&last_timeout, cc->timer));
+    wait = loop_wait_ms (l, ms);
+    loop_release (l);
+    if (l->cevents[0].fd >= 0)
+        poll (l->cevents, l->ncevents, wait);
     else
-        poll (cevents+1, ncevents-1, need_timer_in (&last_timeout, cc->timer));
-
-    for (i = 1; i < ncevents; i++) {
-        if (cevents[i].revents & (POLLIN|POLLERR|POLLHUP)) {
-            if ((c = evreaders[i]) && !c->delete_me) {
-                if (cevents[i].fd == c->rfd) {
-                    c->xoff = 1;
-                    cevents[i].events &= ~POLLIN;
-                    rel_read (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd
-                         && (cevents[i].revents & (POLLERR|POLLHUP))) {
-                    char addr[NI_MAXHOST] = "unknown";
-                    char port[NI_MAXSERV] = "unknown";
-                    getnameinfo ((const struct sockaddr *) &c->peer, sizeof (c->peer),
-                    addr, sizeof (addr), port, sizeof (port),
-                    NI_DGRAM | NI_NUMERICHOST|NI_NUMERICSERV);
-                    fprintf (stderr, "[received ICMP port unreachable;"
-                    " assuming peer at %s:%s is dead]\n", addr, port);
-                    if (cc->single_connection)
-                    exit (1);
-                    rel_destroy (c->rel);
-                }
-                else if (cevents[i].fd == c->nfd && !c->server) {
-                    packet_t pkt;
-                    int len = debug_recv (c->nfd, &pkt, sizeof (pkt), 0, NULL);
-                    if (len < 0) {
-                        if (errno != EAGAIN)
-                            perror ("recv");
-                    }
-                    else {
-                        rel_recvpkt (c->rel, &pkt, len);
-                        memset (&pkt, 0xc9, len); /* for debugging */
-                    }
-                }
-            }
-        }
-        if ((cevents[i].revents & (POLLOUT|POLLHUP|POLLERR))
-                && evwriters[i])
-            conn_drain (evwriters[i]);
-        if (cevents[i].revents & (POLLHUP|POLLERR)) {
+        poll (l->cevents+1, l->ncevents-1, wait);
+    loop_acquire (l);
+
+    if (l->cevents[2].revents & POLLIN)
+        server_recv (l);
+    l->cevents[2].revents = 0;
+
+    for (i = 1; i < l->ncevents; i++) {
+        conn_event (l->evreaders[i], l->evwriters[i], l->cevents[i].fd,
+                    l->cevents[i].revents, cc);
+        if (l->cevents[i].revents & (POLLHUP|POLLERR)) {
 #if 0
             fprintf (stderr, "%5d Error on fd %d (0x%x)\n",
-            getpid (), cevents[i].fd, cevents[i].revents);
+            getpid (), l->cevents[i].fd, l->cevents[i].revents);
 #endif
             /* If stderr has an error, the tester has probably died, so exit
             * immediately. */
-            if (cevents[i].fd == 2)
+            if (l->cevents[i].fd == 2)
+                exit (1);
+            l->cevents[i].fd = -1;
+        }
+        l->cevents[i].revents = 0;
+    }
+}
+
+static int
+ep_revents (uint32_t events)
+{
+    int revents = 0;
+
+    if (events & EPOLLIN)
+        revents |= POLLIN;
+    if (events & EPOLLOUT)
+        revents |= POLLOUT;
+    if (events & EPOLLERR)
+        revents |= POLLERR;
+    if (events & EPOLLHUP)
+        revents |= POLLHUP;
+    return revents;
+}
+
+static void
+conn_poll_epoll (loop_t *l, const struct config_common *cc, int ms)
+{
+    struct epoll_event evs[64];
+    struct evsrc *src, *nsrc;
+    int i, n, timeout;
+
+    timeout = loop_wait_ms (l, ms);
+    for (src = l->ep_always; src; src = src->next)
+        if (src->events)
+            timeout = 0;
+
+    loop_release (l);
+    n = epoll_wait (l->epfd, evs, sizeof (evs) / sizeof (evs[0]), timeout);
+    loop_acquire (l);
+
+    for (i = 0; i < n; i++) {
+        conn_t *c;
+        int revents = ep_revents (evs[i].events);
+
+        src = evs[i].data.ptr;
+
+#if HAVE_IO_URING
+        if (evs[i].data.ptr == &l->uring)
+            continue;
+#endif /* HAVE_IO_URING */
+        if (evs[i].data.ptr == &l->wakefd)
+            continue;
+        if (l->server && evs[i].data.ptr == l->server) {
+            server_recv (l);
+            continue;
+        }
+        /* If stderr has an error, the tester has probably died, so exit
+         * immediately. */
+        if (!src) {
+            if (revents & (POLLHUP|POLLERR))
                 exit (1);
-            cevents[i].fd = -1;
+            continue;
         }
-        cevents[i].revents = 0;
+        if (src->fd < 0)
+            continue;
+
+        c = src->conn;
+        conn_event (src == &c->wsrc ? NULL : c,
+                    src == &c->nsrc ? NULL
+                    : src == &c->wsrc || c->wfd == c->rfd ? c : NULL,
+                    src->fd, revents, cc);
+        if (revents & (POLLHUP|POLLERR))
+            evsrc_del (src);
+    }
+
+    for (src = l->ep_always; src; src = nsrc) {
+        conn_t *c = src->conn;
+        nsrc = src->next;
+        if (!src->events)
+            continue;
+        conn_event (src == &c->wsrc ? NULL : c,
+                    src == &c->wsrc || c->wfd == c->rfd ? c : NULL,
+                    src->fd, ep_revents (src->events), cc);
     }
+}
+
+/* Dispatch the pending events of in-memory connections, the way
+ * conn_event does for fds */
+static void
+mem_dispatch (loop_t *l)
+{
+    conn_t *c;
+    int ev;
 
-    if (need_timer_in (&last_timeout, cc->timer) == 0) {
-        rel_timer ();
-        clock_gettime (CLOCK_MONOTONIC, &last_timeout);
+    while ((c = l->ready)) {
+        l->ready = c->mem->next_ready;
+        ev = c->mem->pending;
+        c->mem->pending = 0;
+
+        if ((ev & MEM_INPUT) && !c->delete_me && !c->xoff) {
+            conn_rwant (c, 0);
+            rel_read (c->rel);
+        }
+        if ((ev & MEM_DRAINED) && !c->delete_me)
+            rel_output (c->rel);
+        /* Each callback may rel_close the connection */
+        if ((ev & MEM_READABLE) && !c->mem->closed && c->mem->cb.readable)
+            c->mem->cb.readable (c, c->mem->arg);
+        if ((ev & MEM_WRITABLE) && !c->mem->closed && c->mem->cb.writable)
+            c->mem->cb.writable (c, c->mem->arg);
     }
+}
+
+void
+conn_poll (loop_t *l, const struct config_common *cc)
+{
+    conn_poll_timeout (l, cc, -1);
+}
+
+void
+conn_poll_timeout (loop_t *l, const struct config_common *cc, int ms)
+{
+    conn_t *c, *nc;
+
+    pthread_mutex_lock (&l->lock);
+#if HAVE_IO_URING
+    if (l->uring.fd >= 0)
+        uring_submit (l, 0);
+#endif /* HAVE_IO_URING */
+
+    if (l->epfd >= 0)
+        conn_poll_epoll (l, cc, ms);
+    else
+        conn_poll_poll (l, cc, ms);
+
+#if HAVE_IO_URING
+    if (l->uring.fd >= 0)
+        uring_reap (l, cc);
+#endif /* HAVE_IO_URING */
+
+    timer_run (l);
+    mem_dispatch (l);
 
-    for (c = conn_list; c; c = nc) {
+    for (c = l->ndeletes ? l->conns : NULL; c; c = nc) {
         nc = c->next;
-        if (c->delete_me && (c->write_err || !c->outq))
+        /* In-memory connections stay until the application lets go */
+        if (c->delete_me
+                && (c->mem ? c->mem->closed : c->write_err || !c->outlen)) {
+            l->ndeletes--;
             conn_free (c);
+        }
     }
+    pthread_mutex_unlock (&l->lock);
+}
+
+int
+loop_timeout (loop_t *l)
+{
+    int ms;
+
+    pthread_mutex_lock (&l->lock);
+    ms = timer_wait (l);
+    pthread_mutex_unlock (&l->lock);
+    return ms;
 }
 
-uint16_t
-cksum (const void *_data, int len)
+void
+loop_wakeup (loop_t *l)
 {
-    const uint8_t *data = _data;
-    uint32_t sum;
+    uint64_t one = 1;
 
-    for (sum = 0;len >= 2; data += 2, len -= 2)
-        sum += data[0] << 8 | data[1];
-    if (len > 0)
-        sum += data[0] << 8;
-    while (sum > 0xffff)
-        sum = (sum >> 16) + (sum & 0xffff);
-    sum = htons (~sum);
-    return sum ? sum : 0xffff;
+    write (l->wakefd, &one, sizeof (one));
 }
 
 int
@@ -753,8 +2069,9 @@ listen_on (int dgram, struct sockaddr_storage *ss)
     }
 
     if (ss->ss_family == AF_UNIX) {
-        fprintf (stderr, "[listening on %s]\n",
-                    ((struct sockaddr_un *) ss)->sun_path);
+        if (opt_debug)
+            fprintf (stderr, "[listening on %s]\n",
+                        ((struct sockaddr_un *) ss)->sun_path);
         return s;
     }
 
@@ -774,8 +2091,9 @@ listen_on (int dgram, struct sockaddr_storage *ss)
         return -1;
     }
 
-    fprintf (stderr, "[listening on %s port %s]\n",
-                        dgram ? "UDP" : "TCP", portname);
+    if (opt_debug)
+        fprintf (stderr, "[listening on %s port %s]\n",
+                            dgram ? "UDP" : "TCP", portname);
     return s;
 }
 
@@ -799,119 +2117,475 @@ connect_to (int dgram, const struct sockaddr_storage *ss)
     return s;
 }
 
+static void
+rxbatch_init (loop_t *l)
+{
+    int i;
+
+    /* GRO hands us up to 64k of coalesced packets at once */
+    l->rxb.gro = opt_gso;
+    l->rxb.bufsize = l->rxb.gro ? GRO_BUFSIZE : sizeof (packet_t);
+    l->rxb.bufs = xmalloc (opt_batch * l->rxb.bufsize);
+    l->rxb.msgs = xmalloc (opt_batch * sizeof (*l->rxb.msgs));
+    l->rxb.iov = xmalloc (opt_batch * sizeof (*l->rxb.iov));
+    l->rxb.from = xmalloc (opt_batch * sizeof (*l->rxb.from));
+    l->rxb.cmsgs = xmalloc (opt_batch * GRO_CMSGSPACE);
+    memset (l->rxb.msgs, 0, opt_batch * sizeof (*l->rxb.msgs));
+    for (i = 0; i < opt_batch; i++) {
+        l->rxb.iov[i].iov_base = l->rxb.bufs + i * l->rxb.bufsize;
+        l->rxb.iov[i].iov_len = l->rxb.bufsize;
+        l->rxb.msgs[i].msg_hdr.msg_iov = &l->rxb.iov[i];
+        l->rxb.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+/* Ask the kernel to coalesce incoming packets on a UDP socket */
+static void
+set_gro (int s)
+{
+#ifdef UDP_GRO
+    int one = 1;
+    if (setsockopt (s, SOL_UDP, UDP_GRO, &one, sizeof (one)) < 0)
+        perror ("setsockopt UDP_GRO");
+#endif /* UDP_GRO */
+}
+
+/* Size of the packets coalesced into the i-th datagram of a batch */
 static int
-debug_recv (int s, packet_t *buf, size_t len, int flags,
-struct sockaddr_storage *from)
+rxbatch_segsize (loop_t *l, int i)
 {
-    socklen_t socklen = sizeof (*from);
-    int n;
-    if (from)
-        n = recvfrom (s, buf, len, flags, (struct sockaddr *) from, &socklen);
-    else
-        n = recv (s, buf, len, flags);
-    if (opt_debug)
-        print_pkt (buf, "recv", n);
+#ifdef UDP_GRO
+    struct msghdr *mh = &l->rxb.msgs[i].msg_hdr;
+    struct cmsghdr *cm;
+    int segsize;
+
+    for (cm = CMSG_FIRSTHDR (mh); cm; cm = CMSG_NXTHDR (mh, cm))
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy (&segsize, CMSG_DATA (cm), sizeof (segsize));
+            if (segsize > 0)
+                return segsize;
+        }
+#endif /* UDP_GRO */
+    return l->rxb.msgs[i].msg_len;
+}
+
+/* Returns the j-th packet of the i-th datagram in a batch, and its
+ * length in *len, or NULL past the last one. */
+static packet_t *
+rxbatch_pkt (loop_t *l, int i, int j, int *len)
+{
+    int segsize = rxbatch_segsize (l, i);
+    int off = j * segsize;
+    char *p = l->rxb.bufs + i * l->rxb.bufsize + off;
+
+    if (off >= (int) l->rxb.msgs[i].msg_len)
+        return NULL;
+    *len = l->rxb.msgs[i].msg_len - off;
+    if (*len > segsize)
+        *len = segsize;
+    /* Odd segment sizes leave packets unaligned */
+    if ((uintptr_t) p % __alignof__ (packet_t)) {
+        if (*len > (int) sizeof (l->rxb.aligned))
+            *len = sizeof (l->rxb.aligned);
+        memcpy (&l->rxb.aligned, p, *len);
+        return &l->rxb.aligned;
+    }
+    return (packet_t *) p;
+}
+
+/* Receive up to opt_batch datagrams into l->rxb, and their senders
+ * into l->rxb.from if from is non-zero.  Returns the number received. */
+static int
+debug_recvmmsg (loop_t *l, int s, int flags, int from)
+{
+    packet_t *pkt;
+    int i, j, n, len;
+
+    for (i = 0; i < opt_batch; i++) {
+        l->rxb.msgs[i].msg_hdr.msg_name = from ? &l->rxb.from[i] : NULL;
+        l->rxb.msgs[i].msg_hdr.msg_namelen = from ? sizeof (l->rxb.from[i]) : 0;
+        if (l->rxb.gro) {
+            l->rxb.msgs[i].msg_hdr.msg_control = l->rxb.cmsgs + i * GRO_CMSGSPACE;
+            l->rxb.msgs[i].msg_hdr.msg_controllen = GRO_CMSGSPACE;
+        }
+    }
+    n = recvmmsg (s, l->rxb.msgs, opt_batch, flags, NULL);
+    if (opt_debug) {
+        if (n < 0)
+            print_pkt ((packet_t *) l->rxb.bufs, "recv", n);
+        for (i = 0; i < n; i++)
+            for (j = 0; (pkt = rxbatch_pkt (l, i, j, &len)); j++)
+                print_pkt (pkt, "recv", len);
+    }
     return n;
 }
 
-static void
-usage (void)
+loop_t *
+loop_create (void)
 {
-    fprintf (stderr,
-                "usage: %s udp-port [host:]udp-port\n"
-                , progname);
-    exit (1);
+    loop_t *l = xmalloc (sizeof (*l));
+    pthread_mutexattr_t ma;
+
+    memset (l, 0, sizeof (*l));
+    pthread_mutexattr_init (&ma);
+    pthread_mutexattr_settype (&ma, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (&l->lock, &ma);
+    pthread_mutexattr_destroy (&ma);
+    l->epfd = -1;
+    l->gso = opt_gso;
+#if HAVE_IO_URING
+    l->uring.fd = -1;
+#endif /* HAVE_IO_URING */
+    if ((l->wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror ("eventfd");
+        goto err;
+    }
+    if (opt_epoll && (l->epfd = epoll_create1 (0)) < 0) {
+        perror ("epoll_create1");
+        goto err;
+    }
+#if HAVE_IO_URING
+    if (opt_uring && uring_init (l) < 0) {
+        perror ("io_uring_setup");
+        goto err;
+    }
+#else /* !HAVE_IO_URING */
+    if (opt_uring) {
+        fprintf (stderr, "%s: io_uring is not supported\n", progname);
+        goto err;
+    }
+#endif /* !HAVE_IO_URING */
+    rxbatch_init (l);
+
+    if (l->epfd >= 0) {
+        struct epoll_event ev;
+        /* Do catch errors on stderr */
+        ev.events = 0;
+        ev.data.ptr = NULL;
+        epoll_ctl (l->epfd, EPOLL_CTL_ADD, 2, &ev);
+        /* Wake up for loop_wakeup */
+        ev.events = EPOLLIN;
+        ev.data.ptr = &l->wakefd;
+        epoll_ctl (l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev);
+#if HAVE_IO_URING
+        /* Wake up for io_uring completions */
+        ev.events = EPOLLIN;
+        ev.data.ptr = &l->uring;
+        if (l->uring.fd >= 0)
+            epoll_ctl (l->epfd, EPOLL_CTL_ADD, l->uring.fd, &ev);
+#endif /* HAVE_IO_URING */
+    }
+    else {
+        conn_mkevents (l);
+#if HAVE_IO_URING
+        /* Wake up for io_uring completions */
+        l->cevents[0].fd = l->uring.fd;
+        l->cevents[0].events = POLLIN;
+#endif /* HAVE_IO_URING */
+    }
+    return l;
+
+ err:
+    /* uring_init closes the ring itself */
+    if (l->epfd >= 0)
+        close (l->epfd);
+    if (l->wakefd >= 0)
+        close (l->wakefd);
+    pthread_mutex_destroy (&l->lock);
+    free (l);
+    return NULL;
 }
 
-int
-main (int argc, char **argv)
+void
+loop_run (loop_t *l, const struct config_common *cc)
 {
-    struct option o[] = {
-        { "debug", no_argument, NULL, 'd' },
-        { "window", required_argument, NULL, 'w' },
-        { NULL, 0, NULL, 0 }
-    };
-    int opt;
-    char *local = NULL;
-    char *remote = NULL;
-    struct config_common c;
-    struct sigaction sa;
+    while (l->conns)
+        conn_poll (l, cc);
+}
+
+loop_t *
+conn_loop (conn_t *c)
+{
+    return c->loop;
+}
 
-    /* Ignore SIGPIPE, since we may get a lot of these */
-    memset (&sa, 0, sizeof (sa));
-    sa.sa_handler = SIG_IGN;
-    sigaction (SIGPIPE, &sa, NULL);
+rel_t **
+loop_rels (loop_t *l)
+{
+    return &l->rels;
+}
 
-    memset (&c, 0, sizeof (c));
-    c.window = 1;
-    c.timeout = 2000;
+/* Runs a server loop on the socket of the given configuration */
+static void *
+server_run (void *arg)
+{
+    loop_t *l = loop_create ();
 
-    progname = strrchr (argv[0], '/');
-    if (progname)
-        progname++;
+    /* Like any other setup failure of the server */
+    if (!l)
+        exit (1);
+    l->server = arg;
+    if (l->epfd >= 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = l->server;
+        epoll_ctl (l->epfd, EPOLL_CTL_ADD, l->server->udp_socket, &ev);
+    }
     else
-        progname = argv[0];
+        l->cevents_generation++;
+    for (;;)
+        conn_poll (l, &l->server->c);
+    return NULL;
+}
 
-    while ((opt = getopt_long (argc, argv, "cdust:w:l", o, NULL)) != -1)
-        switch (opt) {
-        case 'd':
-            opt_debug = 1;
-            break;
-        case 'l':
-            {
-                char name[40];
-                snprintf (name, sizeof (name), "%d.in.log", (int) getpid ());
-                log_in = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-                if (log_in < 0)
-                    perror (name);
-                snprintf (name, sizeof (name), "%d.out.log", (int) getpid ());
-                log_out = open (name, O_CREAT|O_TRUNC|O_WRONLY, 0666);
-                if (log_out < 0)
-                    perror (name);
-            }
-            break;
-        case 'w':
-            c.window = atoi (optarg);
-            break;
-        case 't':
-            c.timeout = atoi (optarg);
-            break;
-        default:
-            usage ();
-            break;
-        }
+/* Binds a UDP socket to ss with SO_REUSEPORT, so that more sockets can
+ * be bound to it and the kernel spreads the peers over them.  The
+ * first call (n > 0) reads the port back into ss and announces it for
+ * n sockets. */
+static int
+listen_shared (struct sockaddr_storage *ss, int n)
+{
+    int one = 1;
+    socklen_t len = sizeof (*ss);
+    int s = socket (ss->ss_family, SOCK_DGRAM, 0);
+
+    if (s < 0) {
+        perror ("socket");
+        return -1;
+    }
+    if (setsockopt (s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof (one)) < 0
+            || bind (s, (const struct sockaddr *) ss, addrsize (ss)) < 0
+            || getsockname (s, (struct sockaddr *) ss, &len) < 0) {
+        perror ("bind");
+        close (s);
+        return -1;
+    }
+    if (opt_debug && n > 0)
+        fprintf (stderr, "[listening on UDP port %d with %d threads]\n",
+                 ntohs (((struct sockaddr_in *) ss)->sin_port), n);
+    return s;
+}
+
+/* The kernel already keeps each peer on one socket of a reuseport
+ * group by hashing its address, but the hash changes with the group.
+ * This steers by (source address ^ source port) % n instead, so a
+ * peer always lands on the same thread.  The program sees the packet
+ * from the UDP payload on, and assumes IPv4 headers without options. */
+static void
+steer_by_peer (int s, int n)
+{
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        BPF_STMT (BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT (BPF_MISC | BPF_TAX, 0),
+        BPF_STMT (BPF_LD | BPF_H | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_STMT (BPF_ALU | BPF_XOR | BPF_X, 0),
+        BPF_STMT (BPF_ALU | BPF_MOD | BPF_K, n),
+        BPF_STMT (BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = { sizeof (code) / sizeof (code[0]), code };
+
+    if (setsockopt (s, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                    &prog, sizeof (prog)) < 0)
+        perror ("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+#else /* !SO_ATTACH_REUSEPORT_CBPF */
+    fprintf (stderr, "%s: reuseport steering is not supported\n", progname);
+#endif /* !SO_ATTACH_REUSEPORT_CBPF */
+}
 
-    if (optind + 2 != argc || c.window < 1 || c.timeout < 10) {
-        usage ();
+void
+server_main (const char *local, const char *dest, int nthreads, int steer,
+             const struct config_common *cc)
+{
+    /* One UDP socket per thread for all peers, each relayed to its
+     * own TCP connection as it shows up */
+    struct config_server *sc = xmalloc (nthreads * sizeof (*sc));
+    struct sockaddr_storage sl;
+    char *lname = local ? strdup (local) : NULL;
+    char *dname = strdup (dest);
+    pthread_t tid;
+    int i, err;
+
+    memset (sc, 0, sizeof (*sc));
+    sc[0].c = *cc;
+    sc[0].c.single_connection = 0;
+    if (get_address (&sc[0].dest, 0, 0, AF_INET, dname) < 0
+            || get_address (&sl, 1, 1, AF_INET, lname) < 0
+            || (sc[0].udp_socket = nthreads > 1
+                ? listen_shared (&sl, nthreads)
+                : listen_on (1, &sl)) < 0)
+        exit (1);
+    free (lname);
+    free (dname);
+    if (steer && nthreads > 1)
+        steer_by_peer (sc[0].udp_socket, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        if (i > 0) {
+            sc[i] = sc[0];
+            if ((sc[i].udp_socket = listen_shared (&sl, 0)) < 0)
+                exit (1);
+        }
+        make_async (sc[i].udp_socket);
+        if (opt_gso)
+            set_gro (sc[i].udp_socket);
     }
 
-    c.timer = c.timeout / 5;
-    local = argv[optind];
-    remote = argv[optind+1];
+    /* The threads only share what is set up by now, each loop keeps
+     * its own state and only reads the options */
+    for (i = 1; i < nthreads; i++)
+        if ((err = pthread_create (&tid, NULL, server_run, &sc[i]))) {
+            fprintf (stderr, "pthread_create: %s\n", strerror (err));
+            exit (1);
+        }
+    server_run (&sc[0]);
+}
 
+/* Sets up a client connection between UDP addresses local and
+ * remote, whose stream goes through rfd and wfd, or through memory
+ * if mem is non-NULL.  Returns NULL on failure. */
+static conn_t *
+conn_connect (loop_t *l, const char *local, const char *remote,
+              int rfd, int wfd, struct memio *mem,
+              const struct config_common *cc)
+{
     struct sockaddr_storage sl, sr;
-    conn_t *cn = conn_alloc ();
-    c.single_connection = 1;
-    cn->rfd = 0;
-    cn->wfd = 1;
-    if (get_address (&sr, 0, 1, AF_INET, remote) < 0
-            || get_address (&sl, 1, 1, sr.ss_family, local) < 0
-            || (cn->nfd = listen_on (1, &sl)) < 0)
-        exit (1);
-    if (connect (cn->nfd, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
+    char *lname = local ? strdup (local) : NULL;
+    char *rname = strdup (remote);
+    conn_t *c;
+    int s = -1, err;
+
+    err = get_address (&sr, 0, 1, AF_INET, rname) < 0
+        || get_address (&sl, 1, 1, sr.ss_family, lname) < 0
+        || (s = listen_on (1, &sl)) < 0;
+    if (!err && connect (s, (struct sockaddr *) &sr, addrsize (&sr)) < 0) {
         perror ("connect");
-        exit (1);
+        close (s);
+        err = 1;
     }
-    cn->server = 0;
-    cn->peer = sr;
-    make_async (cn->rfd);
-    make_async (cn->wfd);
-    make_async (cn->nfd);
-    cn->rel = rel_create (cn, NULL, &c);
+    free (lname);
+    free (rname);
+    if (err)
+        return NULL;
 
-    conn_mkevents ();
-    while (conn_list)
-        conn_poll (&c);
+    c = conn_alloc (l);
+    c->rfd = rfd;
+    c->wfd = wfd;
+    c->nfd = s;
+    c->peer = sr;
+    c->mem = mem;
+    if (!mem) {
+        make_async (c->rfd);
+        make_async (c->wfd);
+    }
+    make_async (c->nfd);
+    /* io_uring receives into packet-sized buffers, without GRO */
+    if (opt_gso && !uring_enabled (l))
+        set_gro (c->nfd);
+    if (!(c->rel = rel_create (l, c, NULL, cc))) {
+        c->mem = NULL;		/* still the caller's */
+        conn_free (c);
+        return NULL;
+    }
 
-    return 0;
+    conn_register (c);
+    return c;
+}
+
+conn_t *
+conn_open (loop_t *l, const char *local, const char *remote,
+           int rfd, int wfd, const struct config_common *cc)
+{
+    return conn_connect (l, local, remote, rfd, wfd, NULL, cc);
+}
+
+conn_t *
+rel_open (loop_t *l, const char *local, const char *remote,
+          const struct config_common *cc,
+          const struct rel_callbacks *cb, void *arg)
+{
+    struct memio *m = xmalloc (sizeof (*m));
+    conn_t *c;
+
+    memset (m, 0, sizeof (*m));
+    if (cb)
+        m->cb = *cb;
+    m->arg = arg;
+    m->inq = xmalloc (opt_outbuf);
+    if (!(c = conn_connect (l, local, remote, -1, -1, m, cc))) {
+        free (m->inq);
+        free (m);
+    }
+    return c;
+}
+
+int
+rel_send (conn_t *c, const void *buf, size_t len)
+{
+    struct memio *m = c->mem;
+    loop_t *l = c->loop;
+    size_t n;
+
+    pthread_mutex_lock (&l->lock);
+    if (m->in_eof || c->delete_me) {
+        pthread_mutex_unlock (&l->lock);
+        return -1;
+    }
+    n = opt_outbuf - m->inlen;
+    if (n > len)
+        n = len;
+    if (n) {
+        ring_put (m->inq, m->inhead, &m->inlen, buf, n);
+        if (!c->xoff)
+            mem_notify (c, MEM_INPUT);
+    }
+    pthread_mutex_unlock (&l->lock);
+    return n;
+}
+
+int
+rel_recv (conn_t *c, void *buf, size_t len)
+{
+    loop_t *l = c->loop;
+    size_t n;
+    int r;
+
+    pthread_mutex_lock (&l->lock);
+    n = ring_get (c->outq, &c->outhead, &c->outlen, buf, len);
+    if (n) {
+        if (!c->delete_me)
+            mem_notify (c, MEM_DRAINED);
+        r = n;
+    }
+    else
+        r = c->write_eof || c->delete_me ? -1 : 0;
+    pthread_mutex_unlock (&l->lock);
+    return r;
+}
+
+void
+rel_shutdown (conn_t *c)
+{
+    loop_t *l = c->loop;
+
+    pthread_mutex_lock (&l->lock);
+    if (!c->mem->in_eof) {
+        c->mem->in_eof = 1;
+        if (!c->xoff)
+            mem_notify (c, MEM_INPUT);
+    }
+    pthread_mutex_unlock (&l->lock);
+}
+
+void
+rel_close (conn_t *c)
+{
+    loop_t *l = c->loop;
+
+    pthread_mutex_lock (&l->lock);
+    c->mem->closed = 1;
+    if (!c->delete_me)
+        rel_destroy (c->rel);
+    else if (l->waiting)
+        loop_wakeup (l);	/* so the loop frees it */
+    pthread_mutex_unlock (&l->lock);
 }
@@ -4,6 +4,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /* -----------------------------------------------------------------------
 
@@ -88,11 +89,11 @@ typedef struct packet packet_t;
 
      <local-IP-address, local-UDP-port, remote-IP-address, remote-UDP-port>
 
-     In stand-alone mode, and in the client, the task of connection
-     demultiplexing is handled automatically for you.  In server
-     mode, you must demultiplex packets yourself.  A useful function
-     for this is addreq(), which compares two sockaddr_storage
-     structures and tells you if they are the same.
+     Connection demultiplexing is handled automatically for you.  In
+     server mode (-s), all peers share one UDP socket, and the library
+     looks up each sender in a hash table keyed by addrhash().  The
+     first data packet (seqno 1) from an unknown peer creates a new
+     session with rel_create (NULL, &peer, cc).
 
    * The configuration of the program is described by a structure
      config_common that gets passed to various functions.  The most
@@ -162,31 +163,66 @@ typedef struct packet packet_t;
      point you can send out more Acks to get more data from the remote
      side.
 
-   * The function rel_timer is called periodically, currently at a
-     rate 1/5 of the retransmission interval.  You can use this timer
-     to inspect packets and retransmit packets that have not been
-     acknowledged.  Do not retransmit every packet every time the
-     timer is fired!  You must keep track of which packets need to be
-     retransmitted when.
+   * The function rel_timer is called for a connection once the timer
+     set with conn_settimer expires.  Use it to retransmit the packets
+     that have not been acknowledged in time, and set the timer again
+     for the next packet that will time out.  Connections without a
+     timer set cost nothing while idle.
 
 */
 
+/* Longest ack_delay in ms.  A delayed ACK has to reach the sender well
+ * before its smallest retransmission timeout (10 ms) expires, or every
+ * packet acknowledged late is retransmitted for nothing. */
+#define ACK_DELAY_MAX 5
+
 struct config_common {
     int window;			/* # of unacknowledged packets in flight */
-    int timer;			/* How often rel_timer called in milliseconds */
-    int timeout;			/* Retransmission timeout in milliseconds */
+    int timeout;			/* Initial retransmission timeout in ms */
     int single_connection;        /* Exit after first connection failure */
+    int nagle;			/* Coalesce input into full packets */
+    int cork;			/* ms partial packets may be held back, 0 = until acked */
+    int ack_every;		/* Acknowledge every this many in-order packets */
+    int ack_delay;		/* ...or this many ms after the first of them,
+				 * at most ACK_DELAY_MAX */
+    int max_retries;		/* Give up after this many retransmissions
+				 * without a reply from the peer, 0 = never */
 };
 
 typedef struct reliable_state rel_t;
 
 extern char *progname;		/* Set to name of program by main */
-extern int opt_debug;		/* When != 0, print packets */
+extern int opt_debug;		/* When != 0, print packets and progress */
+extern int log_in, log_out;	/* When >= 0, copies of input and output */
+
+/* Options, to be set before any loop is created */
+extern int opt_epoll;		/* Wait for events with epoll, not poll */
+extern int opt_uring;		/* Send and receive through io_uring */
+extern int opt_batch;		/* Datagrams received per recvmmsg */
+extern int opt_gso;		/* Coalesce full packets with GSO/GRO */
+extern size_t opt_outbuf;	/* Capacity of each stream buffer, at
+				 * least a packet's payload (500) */
+extern int opt_mmap;		/* Map regular input files, which must
+				 * not change size while they're sent */
 
 #if !DMALLOC
 void *xmalloc (size_t);
 #endif /* !DMALLOC */
 uint16_t cksum (const void *_data, int len); /* compute TCP-like checksum */
+uint16_t cksum_update (uint16_t sum, const void *old, const void *new,
+		       int len); /* patch sum for a changed field */
+uint16_t cksum_combine (uint16_t a, uint16_t b); /* cksum of two buffers
+						  * back to back */
+
+/* The implementations cksum() can choose from, the ones the CPU
+ * supports are listed slowest to fastest, followed by an entry with
+ * a NULL name.  cksum() uses the last one, except for short inputs,
+ * which the scalar loop sums faster. */
+struct cksum_kernel {
+    const char *name;
+    uint16_t (*fn) (const void *_data, int len);
+};
+const struct cksum_kernel *cksum_kernels (void);
 
 
 /* Returns 1 when two addresses equal, 0 otherwise */
@@ -209,13 +245,54 @@ void print_pkt (const packet_t *buf, const char *op, int n);
  * pointers to it.  */
 typedef struct conn conn_t;
 
+/* An event loop and the connections it serves, also opaque.  Each
+ * loop is independent of the others, so several of them can run in
+ * different threads of one process. */
+typedef struct loop loop_t;
+
+/* Create an empty loop.  Returns NULL if the event mechanisms it
+ * needs (eventfd, epoll or io_uring, depending on the options) can't
+ * be set up. */
+loop_t *loop_create (void);
+
+/* Wait for and dispatch one round of events and timers of a loop */
+void conn_poll (loop_t *, const struct config_common *);
+
+/* Like conn_poll, but wait at most ms milliseconds, 0 to only dispatch
+ * what is ready, or -1 to wait as long as conn_poll */
+void conn_poll_timeout (loop_t *, const struct config_common *, int ms);
+
+/* Milliseconds until a loop's next timer expires, 0 if it has events
+ * pending, or -1 if it only waits for I/O.  For driving it from
+ * another event loop with conn_poll_timeout (l, cc, 0). */
+int loop_timeout (loop_t *);
+
+/* Interrupt a loop waiting in conn_poll, from any thread */
+void loop_wakeup (loop_t *);
+
+/* The loop a connection belongs to */
+loop_t *conn_loop (conn_t *c);
+
+/* Head of the list of reliable's sessions of a loop, where rel_create
+ * links in new sessions. */
+rel_t **loop_rels (loop_t *);
+
 /* You only need to call this in the server, when rel_create gets a
  * NULL conn_t. */
-conn_t *conn_create (rel_t *, const struct sockaddr_storage *);
+conn_t *conn_create (loop_t *, rel_t *, const struct sockaddr_storage *);
 
 /* Call this function to send a UDP packet to the other side. */
 int conn_sendpkt (conn_t *c, const packet_t *pkt, size_t len);
 
+/* Send several UDP packets at once, each iovec holds one packet.
+ * Returns the number of packets sent, or -1 if none could be sent. */
+int conn_sendpkts (conn_t *c, const struct iovec *pkts, int npkts);
+
+/* Like conn_sendpkts, but each packet is gathered from iovper
+ * consecutive iovecs, the first of which holds the whole header. */
+int conn_sendpktsv (conn_t *c, const struct iovec *iov, int npkts,
+		    int iovper);
+
 /* This function tells you how many bytes of output buffering are free
  * for conn_output to store your data.  conn_output is guaranteed not
  * to return 0 if you write less than this many bytes. */
@@ -234,18 +311,40 @@ size_t conn_bufspace (conn_t *c);
  * write. */
 int conn_output (conn_t *c, const void *buf, size_t len);
 
+/* Like conn_output, but gathers the data from several buffers.  The
+ * buffers are written out directly when nothing is queued, and only
+ * what the kernel doesn't take right away is copied. */
+int conn_outputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
 /* Get some input from the reliable side.  You must must then put the
  * data into UDP sockets which you send out with conn_sendpkt.  This
  * function returns the number of bytes received, 0 if there is no
  * data currently available, and -1 on EOF or error. */
 int conn_input (conn_t *c, void *buf, size_t len);
 
+/* Like conn_input, but scatters the data over several buffers, which
+ * are filled in order.  Returns the total number of bytes read. */
+int conn_inputv (conn_t *c, const struct iovec *iov, int iovcnt);
+
+/* If the input is a regular file and mapping it is enabled (-m),
+ * maps the unread rest of it and returns it with its length in *len.
+ * The mapping stays valid until the connection is destroyed.  The
+ * caller takes over reading the input, rel_read is still called once
+ * it is readable, but not conn_input.  Returns NULL otherwise.
+ * The file is sent at the size it had here: data appended later is
+ * never sent, and truncating it while it's sent raises SIGBUS. */
+const void *conn_inputmap (conn_t *c, size_t *len);
+
+/* Call rel_timer for this connection in ms milliseconds, replacing
+ * any earlier timer.  A negative value cancels the timer. */
+void conn_settimer (conn_t *c, long ms);
+
 /* Deallocate a connection */
 void conn_destroy (conn_t *c);
 
 /* Functions you must provide (in reliable.c). */
 
-rel_t *rel_create (conn_t *, const struct sockaddr_storage *,
+rel_t *rel_create (loop_t *, conn_t *, const struct sockaddr_storage *,
 		   const struct config_common *);
 void rel_destroy (rel_t *);
 
@@ -255,7 +354,64 @@ void rel_recvpkt (rel_t *, packet_t *pkt, size_t len);
 /* Notification handlers */
 void rel_read (rel_t *);    /* Invoked when you can call conn_input */
 void rel_output (rel_t *);  /* Invoked when some output drained */
-void rel_timer (void); /* Invoked roughly each timer/5 milliseconds */
+void rel_timer (rel_t *);  /* Invoked when the connection's timer expires */
+
+
+/* Running the protocol inside an application (librel).  Link with
+ * librel.a, create a loop and drive it with conn_poll or loop_run.
+ * The streams of connections opened with rel_open are kept in memory
+ * instead of going through file descriptors.
+ *
+ * rel_send, rel_recv, rel_shutdown and rel_close may be called from
+ * other threads than the loop's, they wake the loop up as needed.
+ * Everything else, including the callbacks, runs on the loop's
+ * thread. */
+
+/* Notifications of an in-memory connection, called from the loop */
+struct rel_callbacks {
+    void (*readable) (conn_t *, void *arg); /* rel_recv has data or EOF */
+    void (*writable) (conn_t *, void *arg); /* rel_send has room again */
+};
+
+/* Open a connection from UDP address local ("port", or NULL for any)
+ * to remote ("[host:]port").  Returns NULL on failure.  A peer that
+ * stops responding is only noticed if cc->max_retries is set, the
+ * connection is over once that many retransmissions went unanswered.
+ * A peer that is just slow to read still answers them.  Otherwise it
+ * retransmits until rel_close. */
+conn_t *rel_open (loop_t *, const char *local, const char *remote,
+		  const struct config_common *,
+		  const struct rel_callbacks *, void *arg);
+
+/* Queue up to len bytes for sending.  Never blocks, returns the
+ * number of bytes taken (0 if the buffer is full, wait for writable),
+ * or -1 after rel_shutdown or once the connection is over. */
+int rel_send (conn_t *, const void *buf, size_t len);
+
+/* Take up to len received bytes.  Never blocks, returns the number of
+ * bytes (0 if there are none yet, wait for readable), or -1 once the
+ * other side's EOF has been reached or the connection is over. */
+int rel_recv (conn_t *, void *buf, size_t len);
+
+/* Send EOF once everything queued has been sent */
+void rel_shutdown (conn_t *);
+
+/* Let go of a connection, aborting it if it isn't over yet.  The loop
+ * frees it, it must not be used afterwards. */
+void rel_close (conn_t *);
+
+/* Run a loop until it has no connections left */
+void loop_run (loop_t *, const struct config_common *);
+
+/* Like rel_open, but the stream is read from rfd and written to wfd */
+conn_t *conn_open (loop_t *, const char *local, const char *remote,
+		   int rfd, int wfd, const struct config_common *);
+
+/* Relay every UDP peer of local to its own TCP connection to dest,
+ * with nthreads loops sharing the port.  If steer is non-zero, peers
+ * are steered to the loops by their address.  Never returns. */
+void server_main (const char *local, const char *dest, int nthreads,
+		  int steer, const struct config_common *);
 
 
 